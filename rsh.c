@@ -1,32 +1,229 @@
 //Program developed by Robert Fudge, 2025
 
+//Needed for pipe2 and syscall
+#define _GNU_SOURCE
+
 //Header file include
 #include "rsh.h"
 
 //Standard Library Includes
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 //Posix library include
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <unistd.h>
 
 //System Includes
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 //For interacting with terminal
 #include <termios.h>
 #include <signal.h>
+
+//Vector instructions for scanning input, a scalar loop is used where they are missing
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <errno.h>
 #include <ctype.h>
 
 //Macros
 #define PATH_LENGTH 1024
-
-//Struct for restoring terminal on exit
+#define XARGS_READ_SIZE 65536
+#define XARGS_HEADROOM 2048
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_QUEUED 2
+#define JOB_DONE 3
+#define MAX_WATCHERS 32
+#define PERF_COUNTERS 4
+#define STATS_SLOTS 64                  //Hash slots of the latency table
+#define STATS_SUB_BITS 4                //Each power of two is split into 16 sub-buckets, ~6% precision
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (STATS_SUB_COUNT * 40)
+#define WRITER_CAPACITY (1 << 20)       //Bytes an async writer buffers before it starts dropping
+#define RECORD_CHUNK 16384              //Bytes the recording relay moves per read
+#define RECORD_SIZE_POLL 100            //Milliseconds between checks of the real terminal's size while recording
+#define RC_FILE ".rshrc"
+#define Z_FILE ".rsh_z"                 //Jump database in the home directory
+#define Z_MAGIC 0x5a485352              //"RSHZ"
+#define JOBLOG_SIZE 65536               //Bytes of output kept for each captured background job
+#define JOBLOG_KEEP 16                  //Captured outputs kept, the oldest one of a finished job goes first
+#define Z_BATCH 8                       //Directory visits buffered before the database is rewritten
+#define Z_MAX_RANK 9000.0               //Total rank kept, beyond it every entry is aged and the weakest dropped
+#define CONTROL_REQUEST_SIZE 256
+#define TRACE_EVENTS 4096               //Entries kept by the trace ring, older ones are overwritten
+#define TRACE_TEXT 100
+#define TRACE_COMMAND 0
+#define TRACE_SPAWN 1
+#define TRACE_EXEC 2
+#define TRACE_REAP 3
+#define TRIE_NONE UINT32_MAX
+#define COMPLETION_LIMIT 256            //Candidates shown when a completion is ambiguous
+#define KEY_UP 0x100                    //Key codes above the byte range for decoded escape sequences
+#define KEY_DOWN 0x101
+#define KEY_RIGHT 0x102
+#define KEY_LEFT 0x103
+#define KEY_HOME 0x104
+#define KEY_END 0x105
+#define KEY_DELETE 0x106
+#define KEY_WORD_LEFT 0x107
+#define KEY_WORD_RIGHT 0x108
+#define KEY_ESCAPE 0x109
+#define KEY_UNKNOWN 0x10a
+#define KEY_NONE -1                     //Decoder needs more bytes
+#define KEY_ESC_TIMEOUT 50              //Milliseconds to wait for the rest of a sequence after ESC
+#define KEY_BURST 256                   //Most keys applied before the line is redrawn
+#define DECODE_GROUND 0                 //Key decoder states
+#define DECODE_ESC 1
+#define DECODE_CSI 2
+#define DECODE_SS3 3
+#define HL_PLAIN 0                      //Highlight classes of the characters on the input line
+#define HL_COMMAND 1
+#define HL_UNKNOWN 2
+#define HL_QUOTE 3
+#define HL_OPERATOR 4
+#define HL_HINT 5                       //Dimmed history suggestion after the cursor
+#define PROMPT_DEFAULT "> "
+#define PROMPT_LITERAL 0                //Operations a prompt template compiles to
+#define PROMPT_CWD 1
+#define PROMPT_BRANCH 2
+#define PROMPT_STATUS 3
+#define PROMPT_JOBS 4
+#define PROMPT_DURATION 5
+#define PROMPT_SEGMENT 256              //Longest branch name shown in the prompt
+#define SUGGEST_LIMIT 3                 //Close matches offered for an unknown command
+#define DIR_CACHE_SIZE 8                //Directory listings kept for completion and globbing
+#define DIR_RACY_NS 20000000LL          //A listing read this soon after the last change is not trusted, timestamps are coarse
+#define TASK_PENDING 0
+#define TASK_RUNNING 1
+#define TASK_DONE 2
+#define TASK_FAILED 3
+
+//Struct for restoring terminal on exit, commands also run with it, raw mode is only on while a line is edited
 struct termios orig_termios;
+struct termios raw_termios;
+
+//Environment of the shell, needed to size argument lists
+extern char** environ;
+
+//File descriptor watched by the event loop, the callback runs whenever poll reports one of the events
+struct __watcher {
+    int fd;
+    short events;
+    void (*callback)(int, short, void*);
+    void* data;
+};
+
+//Foreground child and the status change the reaper recorded for it
+struct __fg_proc {
+    pid_t pid;
+    int status;
+    bool changed;
+    struct rusage usage;                //Filled in by wait4 when the child is reaped
+    struct timespec end;                //CLOCK_MONOTONIC time of the reap
+};
+
+//Trie node, children form a sibling list sorted by byte, index 0 is the root so 0 also means "no node"
+struct __trie_node {
+    uint32_t child;
+    uint32_t sibling;
+    uint32_t value;                     //Value of the most recently inserted word at or below this node
+    unsigned char byte;
+    bool terminal;                      //A word ends here
+};
+
+//Trie stored as one array of nodes, so building and freeing it is a handful of allocations
+struct __trie {
+    struct __trie_node* nodes;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+//BK-tree node, children are linked as siblings and labelled with their edit distance to this node
+struct __bk_node {
+    char* word;
+    uint32_t child;
+    uint32_t sibling;
+    int distance;
+};
+
+//BK-tree of command names stored as one array of nodes, the root is node 0
+struct __bk_tree {
+    struct __bk_node* nodes;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+//Header of the jump database file, followed by count records sorted by path and then the path strings
+struct __z_header {
+    uint32_t magic;
+    uint32_t count;
+};
+
+//Jump database entry, the path is length bytes at offset within the string area
+struct __z_record {
+    uint32_t offset;
+    uint32_t length;
+    double rank;                        //Visit count, aged as the database fills up
+    int64_t time;                       //Last visit, seconds since the epoch
+};
+
+//Read only mapping of the jump database, remapped when the file is replaced
+struct __z_db {
+    void* map;
+    size_t size;
+    ino_t ino;
+    struct timespec mtime;
+    uint32_t count;
+    const struct __z_record* records;
+    const char* strings;
+};
+
+//Growable string used to assemble responses
+struct __string_builder {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+//What the input line currently shows after the prompt, so a redraw only writes what changed
+struct __line_view {
+    char text[2 * PATH_LENGTH];         //Input text followed by the suggestion
+    unsigned char colors[2 * PATH_LENGTH];
+    size_t length;
+    size_t cursor;                      //Position of the terminal cursor within the text
+    size_t hint;                        //Length of the suggestion shown after the text
+    size_t place;                       //Screen position of the terminal cursor, row * width + column from the prompt
+    bool pending;                       //Cursor sits past the last column of a full row until something is written
+    size_t width;                       //Terminal width place was laid out with
+};
+
+//Escape sequence decoder, bytes are fed one at a time and complete keys come out
+struct __key_decoder {
+    int state;
+    char params[16];                    //Parameter bytes of a CSI sequence, such as "1;5"
+    int param_length;
+};
 
 //RSH datastructures
 struct __rsh {
@@ -35,6 +232,60 @@ struct __rsh {
     char* path;
     struct __hist_node* hist_buffer;    //Head of history SLL
     struct __job_node* job_buffer;
+    struct __job_group* group_buffer;   //Concurrency limits of named job groups
+    struct __watcher watchers[MAX_WATCHERS];    //File descriptors serviced by the event loop
+    int watcher_count;
+    int sigchld_pipe[2];                //Self-pipe that turns SIGCHLD into an event loop wakeup
+    int winch_pipe[2];                  //Self-pipe for SIGWINCH
+    int sigint_pipe[2];                 //Self-pipe for a SIGINT that ends the shell
+    size_t term_width;                  //Columns of the terminal, kept current through SIGWINCH and read again at each prompt
+    size_t prompt_width;                //Columns the prompt takes
+    struct __fg_proc* fg_procs;         //Foreground children currently being waited on
+    int fg_count;
+    struct timespec last_start;         //Spawn time of the most recent foreground command
+    struct timespec last_end;           //Reap time of its last child
+    struct rusage last_usage;           //Resource usage summed over its children
+    bool time_next;                     //Set by the time keyword, consumed by the next report
+    double report_time;                 //Report commands running longer than this many seconds, negative disables
+    struct __latency_node* stats_table[STATS_SLOTS];    //Runtime histograms keyed by command name
+    char* current_command;              //Command line being executed, NULL at the prompt
+    int last_status;                    //Exit status of the most recent foreground command
+    int last_stages;                    //Number of processes it consisted of
+    struct __async_writer* metrics;     //JSON Lines sink for completed commands, NULL when disabled
+    bool capture_jobs;                  //Background job output goes to in-memory logs instead of the terminal
+    struct __recorder* recorder;        //Session recording, NULL when off
+    struct __job_log* job_logs;         //Captured outputs, most recent first
+    int control_fd;                     //Listening control socket, -1 when disabled
+    char* control_path;
+    struct __trie exec_index;           //Builtins and every executable in path, for completion
+    struct __bk_tree command_tree;      //Names of the executable index by edit distance, built on the first unknown command
+    struct __path_dir* path_dirs;       //Directories the index was built from and their mtimes
+    int path_dir_count;
+    bool exec_index_checked;            //Index validated against the path directories for this prompt
+    struct __dir_listing* dir_cache;    //Recently listed directories, most recently used first
+    struct __trie hist_index;           //Prefixes of history entries, values index hist_entries
+    char** hist_entries;                //History commands in order, owned by the history list
+    uint32_t hist_count;
+    uint32_t hist_capacity;
+    bool ansi;                          //Terminal understands colors and cursor movement, enables highlighting and suggestions
+    struct __line_view view;
+    struct __key_decoder decoder;
+    char* prompt_template;              //Set with "set prompt", see __compile_prompt
+    struct __prompt_op* prompt_ops;     //Template compiled when it is set
+    int prompt_op_count;
+    bool prompt_git;                    //Template shows the branch, so the worker is needed
+    struct __string_builder prompt_buffer;  //Reused for every render
+    struct __string_builder prompt_shown;   //Prompt currently on screen
+    struct __prompt_worker* prompt_worker;
+    bool at_prompt;                     //Reading input, so the prompt may be redrawn
+    char* z_file;                       //Jump database path, NULL without a home directory
+    struct __z_db z_db;
+    struct __z_visit* z_pending;        //Visits since the last rewrite
+    int z_pending_count;
+    int z_pending_capacity;             //Grows past Z_BATCH while a slow rewrite holds up the next one
+    pthread_t z_thread;                 //Rewrites the database off the shell's thread
+    bool z_flushing;
+    bool z_flush_done;                  //Set by the thread as it finishes, so it is only joined once done
 };
 
 //Needed for keeping history (job could technically replace that but imlementation would be more time consuming)
@@ -45,30 +296,380 @@ struct __hist_node {
 
 //Needed for keeping track of jobs running in the foreground and background
 struct __job_node {
-    pid_t pid;
+    int id;                             //Job number shown to the user, %id
+    pid_t pid;                          //0 while the job is still queued
     char* command;
+    char* group;                        //Name of the sem group, NULL for ordinary jobs
     int status;
+    int exit_status;                    //Valid once status is JOB_DONE
+    struct termios modes;               //Terminal modes the job left when it stopped, given back by fg
+    bool has_modes;
     struct __job_node* next;
 };
 
+//Output of a background job kept in memory while capture is on, once full the oldest bytes are overwritten, it
+//outlives the job so the output can be looked at after it finished
+struct __job_log {
+    int id;                             //Job number at launch
+    pid_t pid;
+    char* command;
+    int fd;                             //Read end of the job's stdout and stderr pipe, -1 once every writer closed it
+    char data[JOBLOG_SIZE];
+    size_t head;                        //Where the next byte goes
+    size_t length;                      //Bytes held, at most JOBLOG_SIZE
+    uint64_t dropped;                   //Bytes overwritten
+    struct __job_log* next;
+};
+
+//Buffered file writer drained by its own thread, appending never waits on disk I/O
+struct __async_writer {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char* buffer;                       //Filled by the shell
+    char* spare;                        //Written out by the thread while the shell fills the other one
+    size_t length;
+    bool stop;
+    uint64_t dropped;                   //Bytes discarded because the buffer was full
+};
+
+//Session recording, while it runs the shell's stdout and stderr are a pseudo terminal whose other side a relay thread
+//copies to the real terminal and, with timestamps, into an asciicast v2 file through an async writer
+struct __recorder {
+    int master;
+    int slave;
+    int terminal;                       //The real terminal's output, saved from stdout
+    int saved_err;
+    int stop[2];                        //Wakes the relay thread to finish
+    pthread_t thread;
+    struct __async_writer* cast;
+    struct timespec start;
+    char partial[4];                    //Start of a UTF-8 character cut off by the end of a read
+    size_t partial_length;
+    pthread_mutex_t size_lock;          //The shell and the relay thread both copy the terminal size
+};
+
+//One step of a compiled prompt, literal text or a segment
+struct __prompt_op {
+    int type;
+    char* text;                         //Literal text, NULL for segments
+    size_t length;
+};
+
+//Background worker computing the git state of a directory for the prompt, the shell shows the last result it has
+//and redraws the prompt when a fresh one arrives
+struct __prompt_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char* request;                      //Directory to look at next, NULL when idle
+    bool stop;
+    int notify[2];                      //Written by the worker when a result is ready
+    char cwd[PATH_LENGTH];              //Directory the result below belongs to
+    char branch[PROMPT_SEGMENT];        //Empty outside a repository
+    bool dirty;
+};
+
+//Directory visit not yet written to the database
+struct __z_visit {
+    char* path;
+    double count;
+    int64_t time;
+};
+
+//Visits handed to the thread that rewrites the database
+struct __z_batch {
+    char* file;
+    struct __z_visit* visits;
+    int count;
+    bool* done;
+};
+
+//Directory of the path variable with the modification time seen when it was indexed
+struct __path_dir {
+    char* path;
+    struct timespec mtime;
+};
+
+//Entry of a directory listing, the name points into the listing's string buffer
+struct __dir_entry {
+    char* name;
+    bool is_dir;
+};
+
+//Sorted contents of a directory identified by device and inode, reused until the directory's mtime changes
+struct __dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec listed;             //CLOCK_REALTIME when the directory was read
+    struct __dir_entry* entries;        //Sorted by name
+    char* strings;                      //Names of all entries
+    int count;
+    struct __dir_listing* next;
+};
+
+//Connection to the control socket, the request is a single line and the connection closes after the response
+struct __control_client {
+    int fd;
+    char request[CONTROL_REQUEST_SIZE];
+    size_t request_length;
+    struct __string_builder response;
+    size_t sent;
+};
+
+//Entry of the execution trace, sequence is written last so a reader can skip entries still being filled in
+struct __trace_event {
+    uint64_t sequence;                  //Position in the trace plus one, 0 while being written
+    uint64_t time;                      //CLOCK_MONOTONIC nanoseconds
+    int32_t pid;
+    int32_t type;
+    int32_t status;
+    char text[TRACE_TEXT];
+};
+
+//Ring of trace events in shared memory, forked children record their own exec events into it
+struct __trace_ring {
+    uint64_t head;                      //Total events ever recorded
+    int enabled;
+    struct __trace_event events[TRACE_EVENTS];
+};
+
+//Log bucketed histogram of the wall time of one command, in microseconds
+struct __latency_node {
+    char* command;
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[STATS_BUCKETS];
+    struct __latency_node* next;
+};
+
+//Named group of background jobs admitted by the sem builtin
+struct __job_group {
+    char* name;
+    int limit;
+    struct __job_group* next;
+};
+
+//Node of the task graph used by the tasks builtin
+struct __task {
+    char* name;
+    char** commands;
+    int command_count;
+    char** dep_names;
+    int* deps;              //Resolved indices of dep_names
+    int dep_count;
+    int* dependents;        //Indices of tasks that depend on this one
+    int dependent_count;
+    int remaining;          //Dependencies that have not completed yet
+    int priority;           //Length of the longest path from this task to the end of the graph
+    int state;
+    bool wanted;
+    pid_t pid;
+    struct timespec start;
+};
+
 static bool rsh_initialized = false;
 struct __rsh* rsh;
 
+//Process that owns the event loop, forked children must not write to its self-pipe
+static pid_t event_loop_pid = 0;
+
+//Set when SIGINT arrives while the wait builtin is blocked
+static volatile sig_atomic_t wait_interrupted = 0;
+
+//Execution trace, mapped on the first "set -x" and shared with every child forked after that
+static struct __trace_ring* trace_ring = NULL;
+
+//Escape sequences the decoder knows, CSI sequences start with ESC [ and SS3 ones with ESC O, parameters of CSI
+//sequences must match exactly, modifier combinations not listed decode to KEY_UNKNOWN and are ignored
+static const struct {
+    char introducer;
+    const char* params;
+    char final;
+    int key;
+} key_table[] = {
+    {'[', "", 'A', KEY_UP}, {'[', "", 'B', KEY_DOWN}, {'[', "", 'C', KEY_RIGHT}, {'[', "", 'D', KEY_LEFT},
+    {'[', "", 'H', KEY_HOME}, {'[', "", 'F', KEY_END}, {'[', "1", '~', KEY_HOME}, {'[', "7", '~', KEY_HOME},
+    {'[', "4", '~', KEY_END}, {'[', "8", '~', KEY_END}, {'[', "3", '~', KEY_DELETE},
+    {'[', "1;5", 'C', KEY_WORD_RIGHT}, {'[', "1;5", 'D', KEY_WORD_LEFT}, {'[', "1;3", 'C', KEY_WORD_RIGHT},
+    {'[', "1;3", 'D', KEY_WORD_LEFT},
+    {'O', "", 'A', KEY_UP}, {'O', "", 'B', KEY_DOWN}, {'O', "", 'C', KEY_RIGHT}, {'O', "", 'D', KEY_LEFT},
+    {'O', "", 'H', KEY_HOME}, {'O', "", 'F', KEY_END},
+};
+
+//Code point ranges that take no column of their own (combining marks, joiners, variation selectors) and ranges
+//that take two (East Asian wide and fullwidth forms, emoji), both sorted for binary search
+static const uint32_t zero_width_ranges[][2] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x0900, 0x0903}, {0x093a, 0x094f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a},
+    {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff}, {0x302a, 0x302f},
+    {0x3099, 0x309a}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0x1f3fb, 0x1f3ff}, {0xe0020, 0xe007f},
+    {0xe0100, 0xe01ef},
+};
+
+static const uint32_t wide_ranges[][2] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x2614, 0x2615}, {0x2648, 0x2653},
+    {0x26a1, 0x26a1}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f5, 0x26f5},
+    {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x2728, 0x2728}, {0x274c, 0x274c}, {0x2753, 0x2755}, {0x2795, 0x2797},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff},
+    {0xa000, 0xa4cf}, {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f},
+    {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e},
+    {0x1f191, 0x1f19a}, {0x1f200, 0x1f251}, {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb},
+    {0x1f90c, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+//Escape sequences for each highlight class
+static const char* highlight_colors[] = {"\x1b[0m", "\x1b[32m", "\x1b[31m", "\x1b[33m", "\x1b[36m", "\x1b[2m"};
+
+//Commands handled by the shell itself, offered by completion alongside the executables in path
+static const char* builtin_names[] = {
+    "bg", "cd", "clear", "exit", "fg", "history", "jobqueue", "joblog", "jobs", "perfstat", "record", "sem", "set", "stats",
+    "tasks", "time", "trace", "wait", "xargs", "z", NULL
+};
+
 //Internal functions
+int __cd(int, char**);
 void __append_history(char*);
-void __append_job(pid_t, const char*, int);
+void __bk_clear(struct __bk_tree*);
+void __bk_insert(struct __bk_tree*, char*);
+int __bk_query(struct __bk_tree*, const char*, int, const char**, int*, int);
+bool __command_exists(const char*);
+void __command_finished(const char*, bool);
+void __command_not_found(const char*);
+size_t __complete(char*, size_t, bool);
+void __complete_insert(char*, size_t*, const char*, size_t);
+void __complete_list(char**, int, bool);
+void __control_answer(const char*, struct __string_builder*);
+void __control_close(struct __control_client*);
+void __control_start(void);
+void __control_stop(void);
+void __admit_queued_jobs(void);
+struct __job_node* __append_job(pid_t, const char*, int);
 void __disable_raw_mode(void);
 void __display_history(void);
+void __compile_prompt(const char*);
+int __decode_key(struct __key_decoder*, unsigned char);
+void __draw_prompt(void);
+void __emit_metrics(const char*);
 void __enable_raw_mode(void);
+int __event_wait(int, int);
+bool __event_wait_input(int);
+void __exec_command(char**);
+void __exec_index_refresh(void);
+struct __job_node* __find_job(const char*);
+pid_t __fork_traced(const char*);
+struct __job_group* __get_job_group(const char*, int);
+int __group_running(const char*);
 void __handle_ctrlc(int);
+void __handle_crash(int);
 void __handle_ctrlz(int);
+void __handle_sigchld(int);
+void __handle_sigwinch(int);
+void __handle_wait_interrupt(int);
+void __highlight(const char*, size_t, unsigned char*);
+size_t __ascii_prefix(const char*, size_t);
+int __char_width(uint32_t);
+size_t __display_width(const char*, size_t);
+size_t __grapheme_floor(const char*, size_t, size_t);
+size_t __next_grapheme(const char*, size_t, size_t, int*);
+int __utf8_decode(const char*, size_t, uint32_t*);
+const char* __history_suggest(const char*, size_t);
+int __edit_distance(const char*, const char*);
+int __typo_distance(const char*, const char*);
+bool __git_state(const char*, char*, size_t, bool*);
+size_t __json_escape(char*, size_t, const char*);
 int __handle_input(int, char**, char*);
 int __handle_pipeline(char***, int);
 char** __parse_input(int*, char**);
 char*** __parse_pipeline(char*, int*);
+char* __background_marker(char*);
+int __perf_open(pid_t, uint64_t);
+int __perfstat(int, char**);
+struct __job_node* __launch_background(const char*, const char*);
+int __joblog(int, char**);
+void __job_log_close(struct __job_log*);
+void __on_job_output(int, short, void*);
+void __notify_jobs(void);
+void __on_control_accept(int, short, void*);
+void __on_control_client(int, short, void*);
+void __on_prompt_data(int, short, void*);
+void __on_sigchld(int, short, void*);
+void __on_sigint(int, short, void*);
+void __on_sigwinch(int, short, void*);
+bool __update_term_width(void);
+void __load_rc(void);
+void __prompt_request(void);
+void* __prompt_thread(void*);
+void __prompt_worker_stop(void);
+void __reap_jobs(void);
+void __render_prompt(void);
+int __run_foreground(pid_t, const char*);
 void __remove_job(pid_t);
+void __report_usage(const char*, bool);
+int __record(int, char**);
+void __record_event(struct __recorder*, char, const char*, size_t);
+void* __record_relay(void*);
+int __record_start(const char*);
+void __record_stop(void);
+void __record_sync_size(struct __recorder*);
+int __run_command_line(char*);
+int __sem(int, char**, const char*);
+void __sb_append(struct __string_builder*, const char*, size_t);
+void __sb_printf(struct __string_builder*, const char*, ...);
+int __set(int, char**);
+int __stats(int, char**);
+int __stats_bucket(uint64_t);
+uint64_t __stats_bucket_value(int);
+uint64_t __stats_percentile(struct __latency_node*, double);
+void __stats_record(const char*, uint64_t);
+void __unwatch_fd(int);
+void __update_job(pid_t, int);
+struct __dir_listing* __list_directory(const char*);
+void __free_listing(struct __dir_listing*);
+bool __argv_push(char***, int*, size_t*, const char*);
+bool __next_word(const char**, char*, size_t, bool*);
+void __clear_screen(bool);
+void __redraw_line(void);
+void __refresh_line(const char*, size_t, size_t, bool);
+void __reset_line(void);
+bool __glob_expand(const char*, const char*, char***, int*, size_t*);
+bool __glob_word(const char*, char***, int*, size_t*);
+int __listing_find(struct __dir_listing*, const char*);
+void __trie_clear(struct __trie*);
+int __trie_collect(struct __trie*, uint32_t, char*, size_t, char**, int);
+uint32_t __trie_find(struct __trie*, const char*, size_t);
+void __trie_insert(struct __trie*, const char*, uint32_t);
+int __wait(int, char**);
+int __z(int, char**);
+void __z_flush(bool);
+void* __z_flush_thread(void*);
+void __z_map(void);
+void __z_visit(const char*);
+void __wait_foreground(pid_t*, int*, int);
+bool __watch_fd(int, short, void (*)(int, short, void*), void*);
+void __writer_append(struct __async_writer*, const char*, size_t);
+void __writer_close(struct __async_writer*);
+struct __async_writer* __writer_open(const char*);
+void* __writer_thread(void*);
 struct __rsh* __rsh_get(void);
 void __rsh_destroy(struct __rsh*);
+int __tasks(int, char**);
+void __trace(int, pid_t, int, const char*);
+int __trace_builtin(int, char**);
+void __trace_dump(int, const char*);
+size_t __trace_field(char*, const char*, uint64_t, int, char);
+int __trace_enable(bool);
+char** __tokenize_input(const char*, int*);
+void __tasks_destroy(struct __task*, int);
+int __tasks_find(struct __task*, int, const char*);
+void __tasks_mark_wanted(struct __task*, int);
+struct __task* __tasks_parse(const char*, int*);
+int __xargs(int, char**);
+size_t __xargs_budget(char**, int);
+int __xargs_launch(char**, int, char*, size_t*, int, pid_t*, int*, int);
+int __xargs_reap(pid_t*, int*, int);
 
 //User facing function to run terminal instance
 uint8_t rsh_run(void) {
@@ -77,8 +678,18 @@ uint8_t rsh_run(void) {
 
     int* argc = malloc(1 * sizeof(int));
 
+    //Apply user settings before the first prompt, commands run with the original terminal modes, which are saved
+    //when the shell is initialized
+    __rsh_get();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
+    __load_rc();
+
     //Prompt user and handle input - main loop
     while (true) {
+        //Report background jobs that finished while the previous command ran
+        __reap_jobs();
+        __notify_jobs();
+
         char* raw_input = NULL;
         char** argv = __parse_input(argc, &raw_input);
 
@@ -88,8 +699,16 @@ uint8_t rsh_run(void) {
             continue;
         }
 
+        struct __rsh* r = __rsh_get();
+        r->current_command = strdup(raw_input);
+
         __handle_input(*argc, argv, raw_input);
 
+        free(r->current_command);
+        r->current_command = NULL;
+
+        for (int i = 0; i < *argc; free(argv[i++]));
+        free(argv);
         free(raw_input);
 
     }
@@ -97,15 +716,72 @@ uint8_t rsh_run(void) {
     free(argc);
 }
 
+//Helper function to start queued sem jobs whose group has a free slot
+void __admit_queued_jobs(void) {
+    struct __rsh* r = __rsh_get();
+
+    //Oldest queued jobs sit at the end of the list, they are admitted first
+    bool admitted = true;
+    while (admitted) {
+        admitted = false;
+        struct __job_node* oldest = NULL;
+
+        for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+            if (j->status == JOB_QUEUED && __group_running(j->group) < __get_job_group(j->group, 0)->limit) {
+                oldest = j;
+            }
+        }
+
+        if (oldest != NULL) {
+            pid_t pid = __fork_traced(oldest->command);
+
+            if (pid == 0) {
+                setpgid(0, 0);
+                int pipe_count = 0;
+                char*** commands = __parse_pipeline(oldest->command, &pipe_count);
+
+                if (pipe_count == 1) {
+                    __exec_command(commands[0]);
+                }
+
+                _exit(__handle_pipeline(commands, pipe_count));
+            }
+
+            else if (pid < 0) {
+                perror("fork");
+                return;
+            }
+
+            setpgid(pid, pid);
+            oldest->pid = pid;
+            oldest->status = JOB_RUNNING;
+            admitted = true;
+        }
+    }
+}
+
 //Helper function for adding job to rsh datastructure
-void __append_job(pid_t pid, const char* cmd, int status) {
+struct __job_node* __append_job(pid_t pid, const char* cmd, int status) {
     struct __rsh* r = __rsh_get();
     struct __job_node* new_job = malloc(sizeof(struct __job_node));
+
+    //Job numbers continue after the highest one in use, like other shells
+    int id = 1;
+    for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+        if (j->id >= id) {
+            id = j->id + 1;
+        }
+    }
+
+    new_job->id = id;
     new_job->pid = pid;
     new_job->command = strdup(cmd);
+    new_job->group = NULL;
     new_job->status = status;
+    new_job->has_modes = false;
     new_job->next = r->job_buffer;
     r->job_buffer = new_job;
+    return new_job;
 }
 
 //Helper function to append history to rsh datastructure
@@ -137,563 +813,6855 @@ void __append_history(char* str) {
 
     current->next = to_add;
 
-    return;
-}
+    //Index non-empty commands for suggestions, the newest entry with a prefix wins
+    if (to_add->command[0] != '\0') {
+        if (r->hist_count >= r->hist_capacity) {
+            r->hist_capacity = (r->hist_capacity > 0) ? r->hist_capacity * 2 : 64;
+            r->hist_entries = realloc(r->hist_entries, r->hist_capacity * sizeof(char*));
+        }
 
-//Helper function to disable raw mode
-void __disable_raw_mode(void) {
-    //Write original copy of terminal struct to terminal settings
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+        r->hist_entries[r->hist_count] = to_add->command;
+        __trie_insert(&r->hist_index, to_add->command, r->hist_count);
+        r->hist_count++;
+    }
+
+    return;
 }
 
-//Helper function to display contents of history buffer
-void __display_history(void) {
-    //Get RSH Data structure
-    struct __rsh* r = __rsh_get();
+//Helper function to compute the Levenshtein distance of two words with a single row of the table
+int __edit_distance(const char* a, const char* b) {
+    size_t a_len = strnlen(a, PATH_LENGTH - 1);
+    size_t b_len = strnlen(b, PATH_LENGTH - 1);
+    int row[PATH_LENGTH];
 
-    //Iterate through and print strings
-    struct __hist_node* current = r->hist_buffer->next;
+    for (size_t j = 0; j <= b_len; j++) {
+        row[j] = (int) j;
+    }
 
-    //Iterate to end of list
-    while (current != NULL) {
-        printf("%s\r\n", current->command);
-        current = current->next;
+    for (size_t i = 1; i <= a_len; i++) {
+        int diagonal = row[0];
+        row[0] = (int) i;
+
+        for (size_t j = 1; j <= b_len; j++) {
+            int above = row[j];
+            int best = diagonal + (a[i - 1] != b[j - 1]);
+            best = (above + 1 < best) ? above + 1 : best;
+            best = (row[j - 1] + 1 < best) ? row[j - 1] + 1 : best;
+            diagonal = above;
+            row[j] = best;
+        }
     }
+
+    return row[b_len];
 }
 
+//Helper function to compute the edit distance of two words counting a swap of adjacent letters as one edit, it is
+//not a metric so the BK-tree only uses it to rank what the Levenshtein search found
+int __typo_distance(const char* a, const char* b) {
+    size_t a_len = strnlen(a, PATH_LENGTH - 1);
+    size_t b_len = strnlen(b, PATH_LENGTH - 1);
+    int rows[3][PATH_LENGTH];
 
-//User facing function to enable raw mode for testing
-void __enable_raw_mode(void) {
-    //Initialize terminal struct, retrieving state
-    tcgetattr(STDIN_FILENO, &orig_termios);
+    for (size_t j = 0; j <= b_len; j++) {
+        rows[0][j] = (int) j;
+    }
 
-    //Setup callback for restoring original terminal in case unexpected exit
-    atexit(__disable_raw_mode);
+    for (size_t i = 1; i <= a_len; i++) {
+        int* row = rows[i % 3];
+        int* prev = rows[(i - 1) % 3];
+        int* prev2 = rows[(i + 1) % 3];
+        row[0] = (int) i;
 
-    //Create a copy of the original terminal state
-    struct termios raw = orig_termios;
+        for (size_t j = 1; j <= b_len; j++) {
+            int best = prev[j - 1] + (a[i - 1] != b[j - 1]);
+            best = (prev[j] + 1 < best) ? prev[j] + 1 : best;
+            best = (row[j - 1] + 1 < best) ? row[j - 1] + 1 : best;
 
-    //Use flags to disable all CTRL characters
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag |= (CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && prev2[j - 2] + 1 < best) {
+                best = prev2[j - 2] + 1;
+            }
 
-    //Write modified settings to struct
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+            row[j] = best;
+        }
+    }
+
+    return rows[a_len % 3][b_len];
 }
 
-//Agnostic of whether its caused by a signal or byte, the program needs to exit
-void __handle_ctrlc(int sig) {
-    //Get handle of rsh datastructure
-    struct __rsh* r = __rsh_get();
+//Helper function to count the leading printable ASCII bytes, sixteen at a time where SSE2 is available, so pasted
+//text and long lines skip the UTF-8 decoding below
+size_t __ascii_prefix(const char* text, size_t length) {
+    size_t i = 0;
 
-    if (r->running_process != 0) {
-        kill(r->running_process, SIGINT);
-    }
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
 
-    else {
-        printf("\r\n");
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (text + i));
 
-        //Destroy RSH struct
-        __rsh_destroy(rsh);
-        exit(0);
-    }
-}
+        //Bytes above 0x7f are negative when compared as signed, so one compare finds them with control characters
+        int stop = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(chunk, space), _mm_cmpeq_epi8(chunk, del)));
 
-//Helper function to handle ctrl+z
-void __handle_ctrlz(int sig) {
-    struct __rsh* r = __rsh_get();
-    if (r->running_process != 0) {
-        kill(r->running_process, SIGTSTP);
-        int status;
-        waitpid(r->running_process, &status, WUNTRACED);
-        if (WIFSTOPPED(status)) {
-            __append_job(r->running_process, "command", 1); //Store actual command
+        if (stop != 0) {
+            return i + __builtin_ctz(stop);
         }
-        r->running_process = 0;
     }
+#endif
+
+    while (i < length && (unsigned char) text[i] >= 0x20 && (unsigned char) text[i] < 0x7f) {
+        i++;
+    }
+
+    return i;
 }
 
-//Helper function to determine if input is valid
-int __handle_input(int argc, char** argv, char* raw_input) {
-    //Get handle of rsh datastructure
-    struct __rsh* r = __rsh_get();
+//Helper function to decode one UTF-8 character, returns the bytes it takes, malformed, overlong, surrogate and cut
+//off sequences decode as U+FFFD one byte at a time
+int __utf8_decode(const char* text, size_t length, uint32_t* code) {
+    const unsigned char* s = (const unsigned char*) text;
+    int need = (s[0] >= 0xc2 && s[0] <= 0xdf) ? 1 : (s[0] >= 0xe0 && s[0] <= 0xef) ? 2 :
+               (s[0] >= 0xf0 && s[0] <= 0xf4) ? 3 : 0;
 
-    //Handle empty command - Should come first
-    if (argc == 0 || argv[0] == NULL) {
-        return -1;
+    if (s[0] < 0x80) {
+        *code = s[0];
+        return 1;
     }
 
-    //Exit command
-    else if (strcmp(argv[0], "exit") == 0) {
-        __handle_ctrlc(0);
+    if (need == 0 || (size_t) need >= length) {
+        *code = 0xfffd;
+        return 1;
     }
 
-    else if (strcmp(argv[0], "clear")  == 0) {
-        for (uint8_t i = 0; i < 255; i++) {
-            printf("\r\n");
+    uint32_t value = s[0] & (0x3f >> need);
+
+    for (int i = 1; i <= need; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            *code = 0xfffd;
+            return 1;
         }
+
+        value = (value << 6) | (s[i] & 0x3f);
     }
 
-    //Handle job-control commands
-    else if (strcmp(argv[0], "jobs") == 0) {
-        struct __job_node* j = r->job_buffer;
-        while (j) {
-            printf("[%d] %s\t%s\n", j->pid, (j->status == 1) ? "Stopped" : "Running", j->command);
-            j = j->next;
-        }
-        return 0;
+    static const uint32_t smallest[] = {0, 0x80, 0x800, 0x10000};
+    if (value < smallest[need] || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff)) {
+        *code = 0xfffd;
+        return 1;
     }
 
-    else if (strcmp(argv[0], "fg") == 0) {
-        if (argc < 2) {
-            fprintf(stderr, "Usage: fg <pid>\n");
-            return -1;
-        }
+    *code = value;
+    return need + 1;
+}
 
-        pid_t pid = atoi(argv[1]);
+//Helper function to binary search a sorted table of code point ranges
+static bool __in_ranges(uint32_t code, const uint32_t (*ranges)[2], size_t count) {
+    size_t low = 0;
+    size_t high = count;
 
-        //Ned to ignore SIGTTOU when transferring group
-        signal(SIGTTOU, SIG_IGN);
-        tcsetpgrp(STDIN_FILENO, pid);
-        signal(SIGTTOU, SIG_DFL);
+    while (low < high) {
+        size_t mid = (low + high) / 2;
 
-        //Signal entire process group
-        kill(-pid, SIGCONT);
-        waitpid(pid, NULL, WUNTRACED);
+        if (code < ranges[mid][0]) {
+            high = mid;
+        }
 
-        signal(SIGTTOU, SIG_IGN);
-        tcsetpgrp(STDIN_FILENO, getpid());
-        signal(SIGTTOU, SIG_DFL);
+        else if (code > ranges[mid][1]) {
+            low = mid + 1;
+        }
 
-        return 0;
+        else {
+            return true;
+        }
     }
 
-    else if (strcmp(argv[0], "bg") == 0) {
-        if (argc < 2) {
-            fprintf(stderr, "Usage: bg <pid>\n");
-            return -1;
-        }
+    return false;
+}
 
-        //Resume in background
-        pid_t pid = atoi(argv[1]);
-        kill(pid, SIGCONT);
-        __remove_job(pid);
-        return 0;
+//Helper function to find how many terminal columns a code point takes
+int __char_width(uint32_t code) {
+    if (code < 0x300) {
+        return 1;
     }
 
-    int pipe_count = 0;
-    char*** commands = __parse_pipeline(raw_input, &pipe_count);
+    if (__in_ranges(code, zero_width_ranges, sizeof(zero_width_ranges) / sizeof(zero_width_ranges[0]))) {
+        return 0;
+    }
 
-    if (pipe_count > 1) {
-        int res = __handle_pipeline(commands, pipe_count);
+    return __in_ranges(code, wide_ranges, sizeof(wide_ranges) / sizeof(wide_ranges[0])) ? 2 : 1;
+}
 
-        //Cleanup commands array
-        for (int i = 0; i < pipe_count; i++) {
-            for (int j = 0; commands[i][j] != NULL; j++) {
-                free(commands[i][j]);
-            }
+//Helper function to find where the grapheme cluster starting at pos ends, a cluster is a character followed by any
+//zero width ones, and a zero width joiner also pulls in the character after it, the width of the cluster is that
+//of its first character
+size_t __next_grapheme(const char* text, size_t length, size_t pos, int* width) {
+    uint32_t code;
 
-            free(commands[i]);
+    //Printable ASCII not followed by a multi-byte character is a cluster of its own
+    if ((unsigned char) text[pos] < 0x80 && (pos + 1 == length || (unsigned char) text[pos + 1] < 0x80)) {
+        if (width != NULL) {
+            *width = 1;
         }
-
-        free(commands);
-        return res;
+        return pos + 1;
     }
 
-    //History function
-    if (!strcmp(argv[0], "history") || !strcmp(argv[0], "History")) {
-        __display_history();
-        return 0;
-    }
+    pos += __utf8_decode(text + pos, length - pos, &code);
 
-    char* cpy_path = malloc(PATH_LENGTH * sizeof(char));
-    strcpy(cpy_path, rsh->path);
+    if (width != NULL) {
+        *width = __char_width(code);
+    }
 
-    //Fork to create child process
-    pid_t id = fork();
+    bool joined = false;
+    while (pos < length) {
+        uint32_t next;
+        int size = __utf8_decode(text + pos, length - pos, &next);
 
-    //If in child process
-    if (id == 0) {
-        //Create new process group
-        setpgid(0, 0);
+        if (!joined && (next < 0x300 || __char_width(next) != 0)) {
+            break;
+        }
 
-        //Execute command directly using execvp
-        execvp(argv[0], argv);
-        
-        //If execvp returns, there was an error
-        perror("execvp failed");
-        _exit(127); //Use status 127 for "command not found"
+        joined = (next == 0x200d);
+        pos += size;
     }
 
-    //Parent process
-    else if (id > 0) {
-        //Set child process ID
-        setpgid(id, id);
+    return pos;
+}
 
-        //Set child as foreground process group
-        signal(SIGTTOU, SIG_IGN);
-        tcsetpgrp(STDIN_FILENO, id);
-        signal(SIGTTOU, SIG_DFL);
+//Helper function to find the start of the grapheme cluster holding byte pos, the end of the text counts as a start
+size_t __grapheme_floor(const char* text, size_t length, size_t pos) {
+    size_t start = 0;
+    size_t i = 0;
 
-        //Ignore signals while child is running
-        signal(SIGINT, SIG_IGN);
-        signal(SIGTSTP, SIG_IGN);
+    while (i < length && i <= pos) {
+        size_t run = __ascii_prefix(text + i, length - i);
 
-        //Store running process ID
-        r->running_process = id;
-        int status;
-        
-        //Wait for child process
-        do {
-            waitpid(id, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status) && !WIFSTOPPED(status));
-
-        //Restore signal handlers
-        signal(SIGINT, __handle_ctrlc);
-        signal(SIGTSTP, __handle_ctrlz);
-
-        //Reset terminal foreground to shell safely
-        signal(SIGTTOU, SIG_IGN);
-        tcsetpgrp(STDIN_FILENO, getpid());
-        signal(SIGTTOU, SIG_DFL);
+        //Every character of an ASCII run but the last starts a cluster, the last may still take combining marks
+        if (run > 1) {
+            if (pos < i + run - 1) {
+                return pos;
+            }
 
-        //Handle job status
-        if (WIFSTOPPED(status)) {
-            __append_job(id, argv[0], 1); //Add to jobs as stopped
-        } else {
-            __remove_job(id); //Remove from jobs if exited
+            i += run - 1;
         }
 
-        r->running_process = 0;
+        start = i;
+        i = __next_grapheme(text, length, i, NULL);
     }
 
-    else {
-        fprintf(stderr, "Error: Fork failed\r\n");
-        return -1;
+    return (i <= pos) ? i : start;
+}
+
+//Helper function to find how many terminal columns a piece of text takes
+size_t __display_width(const char* text, size_t length) {
+    size_t columns = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        size_t run = __ascii_prefix(text + i, length - i);
+        columns += run;
+        i += run;
+
+        if (i < length) {
+            int width;
+            i = __next_grapheme(text, length, i, &width);
+            columns += width;
+        }
     }
 
-    return 0; //Remove the "command not found" message
-        
-    printf("No executable with the name %s found in path: %s\r\n", argv[0], rsh->path);
-    return -2;
+    return columns;
 }
 
-//Helper fucntion for handling pipelining
-int __handle_pipeline(char*** commands, int num_commands) {
-    int prev_pipe[2];
-    int next_pipe[2];
-    pid_t pids[num_commands];
+//Helper function to classify every character of the input line, command words are looked up in the executable index
+//so highlighting never touches the file system while typing, words containing a slash are left plain
+void __highlight(const char* buffer, size_t length, unsigned char* colors) {
+    struct __rsh* r = __rsh_get();
+    bool command = true;
+    size_t i = 0;
 
-    for (int i = 0; i < num_commands; i++) {
-        if (i < num_commands - 1) {
-            if (pipe(next_pipe) < 0) {
-                //Pipe failed, return with error
-                printf("Error (FATAL): Could not open pipe");
-                return -1;
-            }
+    while (i < length) {
+        if (buffer[i] == ' ' || buffer[i] == '\t') {
+            colors[i++] = HL_PLAIN;
+            continue;
         }
 
-        pid_t pid = fork();
+        if (buffer[i] == '|' || buffer[i] == '&') {
+            colors[i++] = HL_OPERATOR;
+            command = true;
+            continue;
+        }
 
-        //Child process
-        if (pid == 0) {
+        //Scan the word, quoted parts keep their own color and are unquoted for the lookup
+        char word[PATH_LENGTH];
+        size_t word_len = 0;
+        size_t start = i;
+        char quote = 0;
 
-            //Sets up inputs
-            if(i > 0) {
-                dup2(prev_pipe[0], STDIN_FILENO);
-                close(prev_pipe[0]);
-                close(prev_pipe[1]);
+        while (i < length && (quote != 0 || (buffer[i] != ' ' && buffer[i] != '\t' && buffer[i] != '|' && buffer[i] != '&'))) {
+            if (quote == 0 && (buffer[i] == '\'' || buffer[i] == '"')) {
+                quote = buffer[i];
+                colors[i] = HL_QUOTE;
             }
 
-            //Sets up outputs
-            if (i < num_commands - 1) {
-                close(next_pipe[0]);
-                dup2(next_pipe[1], STDOUT_FILENO);
-                close(next_pipe[1]);
+            else if (quote != 0 && buffer[i] == quote) {
+                quote = 0;
+                colors[i] = HL_QUOTE;
             }
 
-            execvp(commands[i][0], commands[i]);
-        }
+            else {
+                colors[i] = (quote != 0) ? HL_QUOTE : HL_PLAIN;
+                word[word_len++] = buffer[i];
+            }
 
-        else if (pid < 0) {
-            perror("fork");
-            return -1;
+            i++;
         }
 
-        pids[i] = pid;
+        if (command && memchr(word, '/', word_len) == NULL) {
+            __exec_index_refresh();
+            uint32_t node = __trie_find(&r->exec_index, word, word_len);
+            unsigned char color = (node != TRIE_NONE && r->exec_index.nodes[node].terminal) ? HL_COMMAND : HL_UNKNOWN;
 
-        //If not first run, then close previous pipes
-        if (i > 0) {
-            close(prev_pipe[0]);
-            close(prev_pipe[1]);
+            for (size_t k = start; k < i; k++) {
+                colors[k] = (colors[k] == HL_PLAIN) ? color : colors[k];
+            }
         }
 
-        if (i < num_commands - 1) {
-            prev_pipe[0] = next_pipe[0];
-            prev_pipe[1] = next_pipe[1];
-        }
+        command = false;
     }
+}
 
-    int status = 0;
-    for (int i = 0; i < num_commands; i++) {
-        waitpid(pids[i], &status, 0);
+//Helper function to move the terminal cursor between two byte offsets of the input line by the columns the text
+//between them takes, used without escape sequences, where moving right means writing the characters again
+static void __move_cursor(struct __string_builder* out, const char* text, size_t from, size_t to) {
+    if (to < from) {
+        size_t columns = __display_width(text + to, from - to);
+
+        for (size_t i = 0; i < columns; i++) {
+            __sb_append(out, "\b", 1);
+        }
     }
 
-    return WEXITSTATUS(status);
+    else if (to > from) {
+        __sb_append(out, text + from, to - from);
+    }
 }
 
-//Helper function to get input from user
-char** __parse_input(int* argc, char** input_ptr) {
-//Initialize command variables - input can be as long as path length
-    *input_ptr = malloc(PATH_LENGTH * sizeof(char));
+//Helper function to bring the input line up to date on terminals without escape sequences, everything from the first
+//changed character is written again and a shorter line is erased with spaces
+static void __refresh_plain(const char* buffer, size_t length, size_t cursor) {
+    struct __line_view* v = &__rsh_get()->view;
+    size_t first = 0;
 
-    if (*input_ptr == NULL) {
-        perror("Failed to allocate memory for input");
-        return NULL;
+    while (first < length && first < v->length && buffer[first] == v->text[first]) {
+        first++;
     }
 
-    size_t input_len = 0;
+    if (first < length || first < v->length) {
+        size_t in_new = __grapheme_floor(buffer, length, first);
+        size_t in_old = __grapheme_floor(v->text, v->length, first);
+        first = (in_new < in_old) ? in_new : in_old;
+    }
 
-    //Prompt user for input
-    printf("\r> ");
-    fflush(stdout);
+    struct __string_builder out = {NULL, 0, 0};
+    __move_cursor(&out, v->text, v->cursor, first);
+    __sb_append(&out, buffer + first, length - first);
 
-    //Allocate char to populate to
-    char *c = malloc(sizeof(char));
-    if (c == NULL) {
-        perror("Failed to allocate memory for character");
-        return NULL;
+    size_t old_columns = __display_width(v->text + first, v->length - first);
+    size_t new_columns = __display_width(buffer + first, length - first);
+
+    for (size_t i = new_columns; i < old_columns; i++) {
+        __sb_append(&out, " ", 1);
     }
 
-    //Read input in loop
-    while (true) {
-        //Attempt to read char from stdin
-        int read_res = read(STDIN_FILENO, c, sizeof(char));
+    for (size_t i = new_columns; i < old_columns; i++) {
+        __sb_append(&out, "\b", 1);
+    }
 
-        //If read cannot occur
-        if (read_res == -1) {
-            if (errno == EINTR) {
-                //Signal interrupted read, restart
-                continue;
-            }
+    memcpy(v->text, buffer, length);
+    v->length = length;
 
-            perror("Error (FATAL): Cannot read from stdin");
-            free(c);
-            return NULL;
+    __move_cursor(&out, v->text, length, cursor);
+    v->cursor = cursor;
+
+    if (out.length > 0) {
+        fflush(stdout);
+        write(STDOUT_FILENO, out.data, out.length);
+    }
+
+    free(out.data);
+}
+
+//Helper function to lay the input line out on screen, place[i] is the screen position (row * width + column, counted
+//from the start of the prompt) of the cluster holding byte i and place[length] is where the text ends
+static void __layout_line(const char* text, size_t length, size_t start, size_t width, size_t* place) {
+    size_t pos = start;
+    size_t i = 0;
+
+    while (i < length) {
+        size_t run = __ascii_prefix(text + i, length - i);
+
+        for (size_t end = i + run; i < end; i++) {
+            place[i] = pos++;
         }
 
-        //Handle control characters
-        if (iscntrl((unsigned char)*c)) {
-            //Newline (Enter Key) - Could be \n or \r, add null byte to end of input
-            if (*c == '\n' || *c == '\r') {
-                (*input_ptr)[input_len] = '\0';
-                printf("\r\n");
-                break;
-            }
-            
-            //Handle backspace
-            else if (*c == '\b' || *c == 127) {
-                if (input_len > 0) {
-                    input_len--; //Remove the last character
-                    printf("\b \b"); //Move cursor back, overwrite with space, move back again
-                    fflush(stdout);
-                }
-            }
-            
-            //Add autocomplete at some point
-            else if (*c == '\t') {
-                printf("\t"); // Just print a tab for now
-                fflush(stdout);
+        if (i < length) {
+            int w;
+            size_t next = __next_grapheme(text, length, i, &w);
+
+            //A wide character that does not fit on the end of a row starts the next one
+            if (w == 2 && pos % width == width - 1) {
+                pos++;
             }
 
-            //Handle CTRL+C
-            else if (*c == 0x03) {
-                __handle_ctrlc(0);
+            for (; i < next; i++) {
+                place[i] = pos;
             }
+
+            pos += w;
         }
+    }
 
-        //Not a control character, add to the input buffer
-        else {
-            if (input_len < PATH_LENGTH - 1) {
-                (*input_ptr)[input_len++] = *c; //Add the character to the input buffer
-                printf("%c", *c); //Echo the character to the terminal
-                fflush(stdout);
-            }
-            
-            else {
-                //Input buffer is full
-                printf("\r\nInput too long! Maximum length is %d\r\n", PATH_LENGTH - 1);
-                break;
-            }
+    place[length] = pos;
+}
+
+//Helper function to move the terminal cursor between two screen positions of the input line
+static void __move_to(struct __string_builder* out, struct __line_view* v, size_t to, size_t width) {
+    if (v->pending) {
+        //Moving on from a full row creates the next one if it is not there yet
+        if (to == v->place) {
+            __sb_append(out, "\r\n", 2);
+            v->pending = false;
+            return;
         }
+
+        v->place--;
+        v->pending = false;
     }
 
-    //TODO get capacity from RSH datastructure
-    size_t capacity = 16;
+    size_t from_row = v->place / width;
+    size_t from_col = v->place % width;
+    size_t to_row = to / width;
+    size_t to_col = to % width;
 
-    //Allocate array for char pointers, to store passed tokens, commonly referred to as argv
-    char **argv = malloc(capacity * sizeof(char*));
+    if (to_row < from_row) {
+        __sb_printf(out, "\x1b[%zuA", from_row - to_row);
+    }
 
-    //If malloc failed, return NULL, trying to abandon the !ptr notation as for others reading its harder to determine intent
-    if (argv == NULL) {
-        return NULL;
+    else if (to_row > from_row) {
+        __sb_printf(out, "\x1b[%zuB", to_row - from_row);
     }
 
-    //Argc is to be used to index argv
-    int ind = 0;
+    if (to_col == 0 && from_col != 0) {
+        __sb_append(out, "\r", 1);
+    }
 
-    //Add command to history
-    __append_history(*input_ptr);
+    else if (to_col < from_col) {
+        __sb_printf(out, "\x1b[%zuD", from_col - to_col);
+    }
 
-    char temp_buffer[PATH_LENGTH];
-    strcpy(temp_buffer, *input_ptr);
+    else if (to_col > from_col) {
+        __sb_printf(out, "\x1b[%zuC", to_col - from_col);
+    }
 
-    //Tokenize the input using space, \t, and \n
-    char *token = strtok(temp_buffer, " \t\n");
+    v->place = to;
+}
 
-    //Iterate through token list to find end
-    while (token != NULL) {
-        //If argc ends up surpassing capacity, I need to reallocate, easiest just to double capacity
-        if (ind >= capacity) {
-            capacity *= 2;
-            char **temp = realloc(argv, capacity * sizeof(char *));
+//Helper function to find the first byte laid out on the given row or a later one
+static size_t __row_start(const size_t* place, size_t length, size_t row, size_t width) {
+    size_t low = 0;
+    size_t high = length;
 
-            //If temp could not be reallocated free every pointer in args, free args, free input buffer, and return NULL to caller
-            if (!temp) {
-                for (int i = 0; i < ind; free(argv[i++]));
-                free(argv);
+    while (low < high) {
+        size_t mid = (low + high) / 2;
 
-                return NULL;
-            }
-            argv = temp;
+        if (place[mid] / width < row) {
+            low = mid + 1;
+        }
+
+        else {
+            high = mid;
         }
+    }
 
-        //Duplicate string, allocates memory dynamically on the heap
-        argv[ind] = strdup(token);
+    return low;
+}
 
-        //If the element could not be copied, follow the same destruction procedure as above
-        if (!argv[ind]) {
-            for (int i = 0; i < ind; free(argv[i++]));
-            free(argv);
+//Helper function to bring the input line on screen up to date, the text and suggestion are laid out in rows of the
+//terminal width and compared with what is shown, writing starts at the first changed character and rows that come out
+//the same as before are skipped, everything goes out in one write, suggest shows the history suggestion when the
+//cursor is at the end
+void __refresh_line(const char* buffer, size_t length, size_t cursor, bool suggest) {
+    struct __rsh* r = __rsh_get();
+    struct __line_view* v = &r->view;
 
-            return NULL;
-        }
+    if (!r->ansi) {
+        __refresh_plain(buffer, length, cursor);
+        return;
+    }
+
+    char text[2 * PATH_LENGTH];
+    unsigned char colors[2 * PATH_LENGTH];
+    size_t place[2 * PATH_LENGTH + 1];
+    size_t old_place[2 * PATH_LENGTH + 1];
+
+    const char* suggestion = (suggest && cursor == length) ? __history_suggest(buffer, length) : NULL;
+    size_t hint = (suggestion != NULL) ? strlen(suggestion) - length : 0;
+    size_t total = length + hint;
+    size_t old_total = v->length + v->hint;
+    size_t width = r->term_width;
 
-        //increment argc as an element copied
-        ind++;
+    memcpy(text, buffer, length);
+    memcpy(text + length, suggestion + length, hint);
+    __highlight(buffer, length, colors);
+    memset(colors + length, HL_HINT, hint);
 
-        //Tell strtok  this is a subsequent call by passing NULL
-        token = strtok(NULL, " \t\n");
+    __layout_line(text, total, r->prompt_width, width, place);
+    __layout_line(v->text, old_total, r->prompt_width, width, old_place);
+
+    size_t first = 0;
+    while (first < total && first < old_total && text[first] == v->text[first] && colors[first] == v->colors[first]) {
+        first++;
     }
 
-    //NULL terminate the array
-    argv[ind] = NULL;
+    //Combining marks change the look of the character before them, so whole clusters are redrawn
+    if (first < total || first < old_total) {
+        size_t in_new = __grapheme_floor(text, total, first);
+        size_t in_old = __grapheme_floor(v->text, old_total, first);
+        first = (in_new < in_old) ? in_new : in_old;
+    }
 
-    //Return argc
-    *argc = ind;
+    struct __string_builder out = {NULL, 0, 0};
 
-    //Return the pointer to args
-    return argv;
-}
+    if (first < total || first < old_total) {
+        size_t i = first;
+        bool reached_end = false;
+        __move_to(&out, v, place[first], width);
 
-char*** __parse_pipeline(char* in, int* pipe_count) {
-    char*** commands = malloc(16 * sizeof(char**));
-    *pipe_count = 0;
-    char* saved_ptr;
+        //Every redraw leaves the terminal in the plain color
+        int current = HL_PLAIN;
 
-    char* token = strtok_r(in, "|", &saved_ptr);
+        while (i < total) {
+            size_t row = place[i] / width;
 
+            for (size_t next; i < total && place[i] / width == row; i = next) {
+                int w;
+                next = __next_grapheme(text, total, i, &w);
 
-    while (token != NULL) {
-        char** args = malloc(16 * sizeof(char*));
-        int count = 0;
-        char* space_save;
-        char* arg = strtok_r(token, " \t\n", &space_save);
+                if (colors[i] != current) {
+                    current = colors[i];
+                    __sb_printf(&out, "%s", highlight_colors[current]);
+                }
+
+                __sb_append(&out, text + i, next - i);
+                v->place = place[i] + w;
+            }
+
+            //Blank the column a wide character skipped, which also wraps onto its row
+            while (i < total && v->place < place[i]) {
+                __sb_append(&out, " ", 1);
+                v->place++;
+            }
+
+            v->pending = (v->place % width == 0);
+            reached_end = (i == total);
+
+            //Rows that come out as they already are on screen are left alone
+            while (i < total) {
+                size_t next_row = __row_start(place, total, place[i] / width + 1, width);
+                size_t old_start = __row_start(old_place, old_total, place[i] / width, width);
+                size_t old_end = __row_start(old_place, old_total, place[i] / width + 1, width);
+
+                if (old_start == old_total || next_row - i != old_end - old_start || place[i] != old_place[old_start] ||
+                    memcmp(text + i, v->text + old_start, next_row - i) != 0 ||
+                    memcmp(colors + i, v->colors + old_start, next_row - i) != 0) {
+                    break;
+                }
+
+                i = next_row;
+            }
+
+            //A full row wraps onto the next by itself when writing goes on there
+            if (i < total && !(v->pending && v->place == place[i])) {
+                if (current != HL_PLAIN) {
+                    __sb_printf(&out, "\x1b[0m");
+                    current = HL_PLAIN;
+                }
+
+                __move_to(&out, v, place[i], width);
+            }
+        }
 
-        //Iterate through arguments
-        while (arg != NULL) {
-            args[count++] = strdup(arg);
-            arg = strtok_r(NULL, " \t\n", &space_save);
+        if (current != HL_PLAIN) {
+            __sb_printf(&out, "\x1b[0m");
         }
 
-        //NULL terminate list
-        args[count] = NULL;
+        //What is left of an older, longer line is erased from the end of the new one
+        if (reached_end || place[total] != old_place[old_total]) {
+            __move_to(&out, v, place[total], width);
+            __sb_printf(&out, "\x1b[J");
+        }
 
-        //Looks complex but isnt, derefernce to get value of pipe_count, post-increment
-        commands[(*pipe_count)++] = args;
-        token = strtok_r(NULL, "|", &saved_ptr);
+        memcpy(v->text, text, total);
+        memcpy(v->colors, colors, total);
+        v->length = length;
+        v->hint = hint;
     }
 
-    return commands;
+    //Leave the cursor where editing happens
+    __move_to(&out, v, place[cursor], width);
+    v->cursor = cursor;
+    v->width = width;
+
+    if (out.length > 0) {
+        fflush(stdout);
+        write(STDOUT_FILENO, out.data, out.length);
+    }
+
+    free(out.data);
 }
 
-//
-void __remove_job(pid_t pid) {
+//Helper function to draw the prompt and the input line again from scratch, used when the prompt changes or the
+//terminal is resized, the cursor first goes back to the row the prompt starts on
+void __redraw_line(void) {
     struct __rsh* r = __rsh_get();
-    struct __job_node** curr = &r->job_buffer;
-    while (*curr) {
-        if ((*curr)->pid == pid) {
-            struct __job_node* temp = *curr;
-            *curr = (*curr)->next;
-            free(temp->command);
-            free(temp);
-            return;
+    struct __line_view* v = &r->view;
+    char text[PATH_LENGTH];
+    size_t length = v->length;
+    size_t cursor = v->cursor;
+    memcpy(text, v->text, length);
+
+    if (r->ansi) {
+        //The cursor's position was laid out with the width before the resize
+        size_t row = (v->place - v->pending) / v->width;
+
+        if (row > 0) {
+            printf("\x1b[%zuA", row);
         }
-        curr = &(*curr)->next;
     }
+
+    __draw_prompt();
+    __reset_line();
+    __refresh_line(text, length, cursor, true);
 }
 
-//
-struct __rsh* __rsh_get() {
-    if (!rsh_initialized) {
-        __enable_raw_mode();
+//Helper function to clear the terminal in a single write, homing the cursor and erasing the screen, and the
+//scrollback too when asked, terminals without escape sequences get a screenful of new lines instead
+void __clear_screen(bool scrollback) {
+    struct __rsh* r = __rsh_get();
+    struct __string_builder out = {NULL, 0, 0};
 
-        //Set up handling of ctrl signals
-        signal(SIGINT, __handle_ctrlc);
-        signal(SIGTSTP, __handle_ctrlz);
+    if (r->ansi) {
+        __sb_printf(&out, "\x1b[H\x1b[2J%s", scrollback ? "\x1b[3J" : "");
+    }
 
-        rsh = (struct __rsh*) malloc(sizeof(struct __rsh));
+    else {
+        struct winsize ws;
+        int rows = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) ? ws.ws_row : 24;
 
-        //Initialize "class members"
-        rsh->capacity = 16;
-        rsh->running_process = 0;
-        rsh->hist_buffer = malloc(1 * sizeof(struct __hist_node));
-        rsh->path = strdup(getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin");;
+        for (int i = 0; i < rows; i++) {
+            __sb_append(&out, "\r\n", 2);
+        }
+    }
 
-        rsh->hist_buffer->command = NULL;
-        rsh->hist_buffer->next = NULL;
+    fflush(stdout);
+    write(STDOUT_FILENO, out.data, out.length);
+    free(out.data);
+}
 
-        rsh_initialized = true;
+//Helper function to note that nothing but the prompt is on the input line
+void __reset_line(void) {
+    struct __rsh* r = __rsh_get();
+    r->view.length = 0;
+    r->view.cursor = 0;
+    r->view.hint = 0;
+    r->view.place = r->prompt_width;
+    r->view.pending = (r->prompt_width > 0 && r->prompt_width % r->term_width == 0);
+    r->view.width = r->term_width;
+}
 
-        //Return the pointer to the newly allocated memory
-        return rsh;
+//Helper function to return the most recent history entry extending the prefix, NULL if there is none
+const char* __history_suggest(const char* prefix, size_t length) {
+    struct __rsh* r = __rsh_get();
+
+    if (length == 0) {
+        return NULL;
     }
-    
-    return rsh;
+
+    uint32_t node = __trie_find(&r->hist_index, prefix, length);
+
+    if (node == TRIE_NONE || strlen(r->hist_entries[r->hist_index.nodes[node].value]) == length) {
+        return NULL;
+    }
+
+    return r->hist_entries[r->hist_index.nodes[node].value];
 }
 
-//Helper function to destroy the rsh datastructure and any contained elements
-void __rsh_destroy(struct __rsh* r) {
-    //Clean history
-    struct __hist_node* hist = r->hist_buffer;
-    while (hist) {
-        struct __hist_node* next = hist->next;
-        free(hist->command);
-        free(hist);
-        hist = next;
+//Helper function to free every word of a BK-tree
+void __bk_clear(struct __bk_tree* t) {
+    for (uint32_t i = 0; i < t->count; i++) {
+        free(t->nodes[i].word);
     }
-    
-    //Clean jobs
-    struct __job_node* job = r->job_buffer;
-    while (job) {
-        struct __job_node* next = job->next;
-        free(job->command);
-        free(job);
-        job = next;
+
+    free(t->nodes);
+    t->nodes = NULL;
+    t->count = 0;
+    t->capacity = 0;
+}
+
+//Helper function to add a word, which the tree takes ownership of, walking down the edges labelled with its distance
+void __bk_insert(struct __bk_tree* t, char* word) {
+    if (t->count >= t->capacity) {
+        t->capacity = (t->capacity > 0) ? t->capacity * 2 : 1024;
+        t->nodes = realloc(t->nodes, t->capacity * sizeof(struct __bk_node));
     }
 
-    free(r->path);
-    free(r);
-}
\ No newline at end of file
+    uint32_t created = t->count++;
+    t->nodes[created].word = word;
+    t->nodes[created].child = 0;
+    t->nodes[created].sibling = 0;
+    t->nodes[created].distance = 0;
+
+    if (created == 0) {
+        return;
+    }
+
+    uint32_t node = 0;
+
+    while (true) {
+        int distance = __edit_distance(word, t->nodes[node].word);
+
+        if (distance == 0) {
+            t->count--;
+            free(word);
+            return;
+        }
+
+        uint32_t c = t->nodes[node].child;
+        while (c != 0 && t->nodes[c].distance != distance) {
+            c = t->nodes[c].sibling;
+        }
+
+        if (c == 0) {
+            t->nodes[created].distance = distance;
+            t->nodes[created].sibling = t->nodes[node].child;
+            t->nodes[node].child = created;
+            return;
+        }
+
+        node = c;
+    }
+}
+
+//Helper function to find up to max words within a typo distance of a word, closest first, a swap costs two plain
+//edits so the tree is searched at twice the tolerance, visiting only subtrees whose edge distance can hold a match
+int __bk_query(struct __bk_tree* t, const char* word, int tolerance, const char** out, int* distances, int max) {
+    if (t->count == 0) {
+        return 0;
+    }
+
+    int found = 0;
+    int reach = tolerance * 2;
+    uint32_t* stack = malloc(t->count * sizeof(uint32_t));
+    uint32_t depth = 0;
+    stack[depth++] = 0;
+
+    while (depth > 0) {
+        uint32_t node = stack[--depth];
+        int distance = __edit_distance(word, t->nodes[node].word);
+
+        int rank = (distance <= reach) ? __typo_distance(word, t->nodes[node].word) : distance;
+
+        //Keep the best matches in order, ties broken by name
+        if (rank <= tolerance) {
+            int at = found;
+
+            while (at > 0 && (distances[at - 1] > rank ||
+                             (distances[at - 1] == rank && strcmp(out[at - 1], t->nodes[node].word) > 0))) {
+                if (at < max) {
+                    out[at] = out[at - 1];
+                    distances[at] = distances[at - 1];
+                }
+                at--;
+            }
+
+            if (at < max) {
+                out[at] = t->nodes[node].word;
+                distances[at] = rank;
+                found += (found < max);
+            }
+        }
+
+        for (uint32_t c = t->nodes[node].child; c != 0; c = t->nodes[c].sibling) {
+            if (t->nodes[c].distance >= distance - reach && t->nodes[c].distance <= distance + reach) {
+                stack[depth++] = c;
+            }
+        }
+    }
+
+    free(stack);
+    return found;
+}
+
+//Helper function to check a command word against the executable index before forking, a miss is confirmed against
+//path so an executable installed since the index was built is still found
+bool __command_exists(const char* name) {
+    struct __rsh* r = __rsh_get();
+
+    //Paths are left to exec
+    if (strchr(name, '/') != NULL) {
+        return true;
+    }
+
+    __exec_index_refresh();
+    uint32_t node = __trie_find(&r->exec_index, name, strlen(name));
+
+    if (node != TRIE_NONE && r->exec_index.nodes[node].terminal) {
+        return true;
+    }
+
+    char* path_copy = strdup(r->path);
+    bool found = false;
+
+    for (char* save = NULL, *dir = strtok_r(path_copy, ":", &save); dir != NULL && !found; dir = strtok_r(NULL, ":", &save)) {
+        char candidate[PATH_LENGTH];
+
+        if (snprintf(candidate, sizeof(candidate), "%s/%s", dir, name) < (int) sizeof(candidate)) {
+            found = (access(candidate, X_OK) == 0);
+        }
+    }
+
+    free(path_copy);
+    return found;
+}
+
+//Helper function to report a command missing from path along with the closest names from the BK-tree
+void __command_not_found(const char* name) {
+    struct __rsh* r = __rsh_get();
+
+    //Build the tree from the index the first time it is needed
+    if (r->command_tree.count == 0 && r->exec_index.count > 0) {
+        char** words = malloc(r->exec_index.count * sizeof(char*));
+        char prefix[PATH_LENGTH];
+        int count = __trie_collect(&r->exec_index, 0, prefix, 0, words, (int) r->exec_index.count);
+
+        for (int i = 0; i < count; i++) {
+            __bk_insert(&r->command_tree, words[i]);
+        }
+
+        free(words);
+    }
+
+    //Short names only tolerate a single edit, anything else would suggest half the index
+    const char* matches[SUGGEST_LIMIT];
+    int distances[SUGGEST_LIMIT];
+    int tolerance = (strlen(name) <= 3) ? 1 : 2;
+    int count = __bk_query(&r->command_tree, name, tolerance, matches, distances, SUGGEST_LIMIT);
+
+    fprintf(stderr, "No executable with the name %s found in path", name);
+
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%s%s", (i == 0) ? ", did you mean: " : ", ", matches[i]);
+    }
+
+    fprintf(stderr, "\r\n");
+}
+
+//Helper function called once a foreground command has been reaped, with its timing in the rsh datastructure
+void __command_finished(const char* command, bool forced) {
+    struct __rsh* r = __rsh_get();
+    int64_t elapsed = (r->last_end.tv_sec - r->last_start.tv_sec) * 1000000LL + (r->last_end.tv_nsec - r->last_start.tv_nsec) / 1000;
+
+    __stats_record(command, elapsed > 0 ? (uint64_t) elapsed : 0);
+    __emit_metrics(command);
+    __report_usage(command, forced);
+}
+
+//Helper function to complete the word before the cursor, the first word of a command is completed from the index
+//of executables and builtins, anything else from the directory listing, a repeated TAB lists ambiguous candidates
+size_t __complete(char* buffer, size_t length, bool list) {
+    struct __rsh* r = __rsh_get();
+
+    //Find the start of the word and whether it is in command position
+    size_t start = length;
+    while (start > 0 && buffer[start - 1] != ' ' && buffer[start - 1] != '|' && buffer[start - 1] != '&') {
+        start--;
+    }
+
+    size_t before = start;
+    while (before > 0 && buffer[before - 1] == ' ') {
+        before--;
+    }
+
+    char word[PATH_LENGTH];
+    size_t word_len = length - start;
+    memcpy(word, buffer + start, word_len);
+    word[word_len] = '\0';
+
+    bool command = (before == 0 || buffer[before - 1] == '|' || buffer[before - 1] == '&') && strchr(word, '/') == NULL;
+
+    if (command) {
+        __exec_index_refresh();
+        struct __trie* t = &r->exec_index;
+        uint32_t node = __trie_find(t, word, word_len);
+
+        if (node == TRIE_NONE) {
+            return length;
+        }
+
+        //Follow the path while it is unambiguous, this is the longest common prefix of all candidates
+        char extension[PATH_LENGTH];
+        size_t ext_len = 0;
+
+        while (!t->nodes[node].terminal && t->nodes[node].child != 0 && t->nodes[t->nodes[node].child].sibling == 0 &&
+               word_len + ext_len + 1 < PATH_LENGTH) {
+            node = t->nodes[node].child;
+            extension[ext_len++] = t->nodes[node].byte;
+        }
+
+        //A single candidate is finished off with a space
+        if (t->nodes[node].terminal && t->nodes[node].child == 0) {
+            extension[ext_len++] = ' ';
+        }
+
+        if (ext_len > 0) {
+            __complete_insert(buffer, &length, extension, ext_len);
+            return length;
+        }
+
+        if (list) {
+            char* candidates[COMPLETION_LIMIT];
+            char prefix[PATH_LENGTH];
+            memcpy(prefix, word, word_len);
+
+            int count = __trie_collect(t, node, prefix, word_len, candidates, COMPLETION_LIMIT);
+            __complete_list(candidates, count, count == COMPLETION_LIMIT);
+
+            for (int i = 0; i < count; free(candidates[i++]));
+            __draw_prompt();
+            __reset_line();
+        }
+
+        return length;
+    }
+
+    //Split into the directory to list and the prefix of the name within it
+    char* slash = strrchr(word, '/');
+    char dir[PATH_LENGTH];
+    const char* base = word;
+
+    if (slash != NULL) {
+        size_t dir_len = slash - word + 1;
+        memcpy(dir, word, dir_len);
+        dir[dir_len] = '\0';
+        base = slash + 1;
+    }
+
+    else {
+        strcpy(dir, ".");
+    }
+
+    struct __dir_listing* listing = __list_directory(dir);
+    if (listing == NULL) {
+        return length;
+    }
+
+    size_t base_len = strlen(base);
+    int first = -1;
+    int matches = 0;
+    size_t common = 0;
+
+    //Names are sorted, so matches are contiguous from the first name not below the prefix, hidden entries are only
+    //offered once a dot is typed
+    for (int i = __listing_find(listing, base); i < listing->count && strncmp(listing->entries[i].name, base, base_len) == 0; i++) {
+        if (base_len == 0 && listing->entries[i].name[0] == '.') {
+            continue;
+        }
+
+        if (first < 0) {
+            first = i;
+            common = strlen(listing->entries[i].name);
+        }
+
+        else {
+            size_t k = 0;
+            while (k < common && listing->entries[first].name[k] == listing->entries[i].name[k]) {
+                k++;
+            }
+            common = k;
+        }
+
+        matches++;
+    }
+
+    if (matches == 0) {
+        return length;
+    }
+
+    if (common > base_len || matches == 1) {
+        char extension[PATH_LENGTH];
+        size_t ext_len = common - base_len;
+        memcpy(extension, listing->entries[first].name + base_len, ext_len);
+
+        if (matches == 1) {
+            extension[ext_len++] = listing->entries[first].is_dir ? '/' : ' ';
+        }
+
+        __complete_insert(buffer, &length, extension, ext_len);
+        return length;
+    }
+
+    if (list) {
+        char* candidates[COMPLETION_LIMIT];
+        int count = 0;
+
+        for (int i = first; i < listing->count && count < COMPLETION_LIMIT && strncmp(listing->entries[i].name, base, base_len) == 0; i++) {
+            if (!(base_len == 0 && listing->entries[i].name[0] == '.')) {
+                size_t name_len = strlen(listing->entries[i].name);
+                candidates[count] = malloc(name_len + 2);
+                memcpy(candidates[count], listing->entries[i].name, name_len);
+                candidates[count][name_len] = listing->entries[i].is_dir ? '/' : '\0';
+                candidates[count][name_len + 1] = '\0';
+                count++;
+            }
+        }
+
+        __complete_list(candidates, count, matches > count);
+
+        for (int i = 0; i < count; free(candidates[i++]));
+        __draw_prompt();
+        __reset_line();
+    }
+
+    return length;
+}
+
+//Helper function to append completed text to the input buffer, it shows up with the next redraw
+void __complete_insert(char* buffer, size_t* length, const char* text, size_t text_len) {
+    if (*length + text_len >= PATH_LENGTH) {
+        return;
+    }
+
+    memcpy(buffer + *length, text, text_len);
+    *length += text_len;
+}
+
+//Helper function to print completion candidates in columns below the input line
+void __complete_list(char** candidates, int count, bool truncated) {
+    struct __rsh* r = __rsh_get();
+    int width = (int) r->term_width;
+    int longest = 1;
+
+    //Go past the last row of the input line first
+    char text[PATH_LENGTH];
+    size_t length = r->view.length;
+    memcpy(text, r->view.text, length);
+    __refresh_line(text, length, length, false);
+
+    for (int i = 0; i < count; i++) {
+        int len = (int) __display_width(candidates[i], strlen(candidates[i]));
+        longest = (len > longest) ? len : longest;
+    }
+
+    int columns = width / (longest + 2);
+    columns = (columns > 0) ? columns : 1;
+
+    printf("\r\n");
+    for (int i = 0; i < count; i++) {
+        printf("%s%*s", candidates[i], longest + 2 - (int) __display_width(candidates[i], strlen(candidates[i])), "");
+
+        if ((i + 1) % columns == 0 || i + 1 == count) {
+            printf("\r\n");
+        }
+    }
+
+    if (truncated) {
+        printf("...\r\n");
+    }
+}
+
+//Helper function to build the JSON response for one control request: "jobs", "running", "history [n]" or "metrics"
+void __control_answer(const char* request, struct __string_builder* out) {
+    struct __rsh* r = __rsh_get();
+    char escaped[PATH_LENGTH * 2];
+
+    if (strcmp(request, "jobs") == 0) {
+        const char* names[] = {"running", "stopped", "queued", "done"};
+        __sb_printf(out, "{\"jobs\":[");
+
+        for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+            __json_escape(escaped, sizeof(escaped), j->command);
+            __sb_printf(out, "%s{\"id\":%d,\"pid\":%d,\"state\":\"%s\",\"command\":\"%s\"", (j == r->job_buffer) ? "" : ",",
+                j->id, j->pid, names[j->status], escaped);
+
+            if (j->group != NULL) {
+                __json_escape(escaped, sizeof(escaped), j->group);
+                __sb_printf(out, ",\"group\":\"%s\"", escaped);
+            }
+
+            __sb_printf(out, "}");
+        }
+
+        __sb_printf(out, "]}\n");
+    }
+
+    else if (strcmp(request, "running") == 0) {
+        if (r->current_command == NULL) {
+            __sb_printf(out, "{\"running\":null}\n");
+            return;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - r->last_start.tv_sec) * 1e3 + (now.tv_nsec - r->last_start.tv_nsec) / 1e6;
+
+        __json_escape(escaped, sizeof(escaped), r->current_command);
+        __sb_printf(out, "{\"running\":\"%s\",\"pid\":%d,\"elapsed_ms\":%.3f}\n", escaped, r->running_process, elapsed);
+    }
+
+    else if (strncmp(request, "history", 7) == 0) {
+        int wanted = (request[7] == ' ') ? atoi(request + 8) : 10;
+        int total = 0;
+
+        for (struct __hist_node* h = r->hist_buffer->next; h != NULL; h = h->next) {
+            total++;
+        }
+
+        //Skip to the last entries of the list
+        int index = 0;
+        bool first = true;
+        __sb_printf(out, "{\"history\":[");
+
+        for (struct __hist_node* h = r->hist_buffer->next; h != NULL; h = h->next, index++) {
+            if (index >= total - wanted) {
+                __json_escape(escaped, sizeof(escaped), h->command);
+                __sb_printf(out, "%s\"%s\"", first ? "" : ",", escaped);
+                first = false;
+            }
+        }
+
+        __sb_printf(out, "]}\n");
+    }
+
+    else if (strcmp(request, "metrics") == 0) {
+        bool first = true;
+        __sb_printf(out, "{\"last\":{\"exit\":%d,\"stages\":%d},\"commands\":[", r->last_status, r->last_stages);
+
+        for (int i = 0; i < STATS_SLOTS; i++) {
+            for (struct __latency_node* node = r->stats_table[i]; node != NULL; node = node->next) {
+                __json_escape(escaped, sizeof(escaped), node->command);
+                __sb_printf(out, "%s{\"command\":\"%s\",\"count\":%lu,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+                    first ? "" : ",", escaped, (unsigned long) node->count,
+                    __stats_percentile(node, 0.50) / 1000.0, __stats_percentile(node, 0.90) / 1000.0,
+                    __stats_percentile(node, 0.99) / 1000.0, node->max / 1000.0);
+                first = false;
+            }
+        }
+
+        __sb_printf(out, "]}\n");
+    }
+
+    else {
+        __sb_printf(out, "{\"error\":\"unknown request, expected jobs, running, history [n] or metrics\"}\n");
+    }
+}
+
+//Helper function to drop a control connection
+void __control_close(struct __control_client* client) {
+    __unwatch_fd(client->fd);
+    close(client->fd);
+    free(client->response.data);
+    free(client);
+}
+
+//Helper function to listen on $XDG_RUNTIME_DIR/rsh-<pid>.sock, connections are served from the event loop
+void __control_start(void) {
+    struct __rsh* r = __rsh_get();
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+
+    if (r->control_fd >= 0) {
+        return;
+    }
+
+    if (dir == NULL) {
+        fprintf(stderr, "control: XDG_RUNTIME_DIR is not set\r\n");
+        return;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/rsh-%d.sock", dir, getpid()) >= (int) sizeof(addr.sun_path)) {
+        fprintf(stderr, "control: socket path too long\r\n");
+        return;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("control");
+        return;
+    }
+
+    unlink(addr.sun_path);
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        perror("control");
+        close(fd);
+        return;
+    }
+
+    //Only the owner may query the shell
+    chmod(addr.sun_path, 0600);
+
+    if (!__watch_fd(fd, POLLIN, __on_control_accept, NULL)) {
+        fprintf(stderr, "control: too many event loop watchers\r\n");
+        unlink(addr.sun_path);
+        close(fd);
+        return;
+    }
+
+    r->control_fd = fd;
+    r->control_path = strdup(addr.sun_path);
+}
+
+//Helper function to close the control socket and remove its file
+void __control_stop(void) {
+    struct __rsh* r = __rsh_get();
+
+    if (r->control_fd < 0) {
+        return;
+    }
+
+    __unwatch_fd(r->control_fd);
+    close(r->control_fd);
+    unlink(r->control_path);
+    free(r->control_path);
+
+    r->control_fd = -1;
+    r->control_path = NULL;
+}
+
+//Helper function to disable raw mode
+void __disable_raw_mode(void) {
+    //Write original copy of terminal struct to terminal settings
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+//Helper function to display contents of history buffer
+void __display_history(void) {
+    //Get RSH Data structure
+    struct __rsh* r = __rsh_get();
+
+    //Iterate through and print strings
+    struct __hist_node* current = r->hist_buffer->next;
+
+    //Iterate to end of list
+    while (current != NULL) {
+        printf("%s\r\n", current->command);
+        current = current->next;
+    }
+}
+
+
+//User facing function to enable raw mode for testing
+void __enable_raw_mode(void) {
+    //Initialize terminal struct, retrieving state
+    tcgetattr(STDIN_FILENO, &orig_termios);
+
+    //Setup callback for restoring original terminal in case unexpected exit
+    atexit(__disable_raw_mode);
+
+    //Create a copy of the original terminal state
+    struct termios raw = orig_termios;
+
+    //Use flags to disable all CTRL characters
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+
+    //Write modified settings to struct
+    raw_termios = raw;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+//Helper function to look up a job by %id or pid
+struct __job_node* __find_job(const char* spec) {
+    struct __rsh* r = __rsh_get();
+    bool by_id = (spec[0] == '%');
+    int value = atoi(by_id ? spec + 1 : spec);
+
+    for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+        if ((by_id && j->id == value) || (!by_id && j->pid == value)) {
+            return j;
+        }
+    }
+
+    return NULL;
+}
+
+//Helper function to get a job group by name, a limit above zero creates or updates it
+struct __job_group* __get_job_group(const char* name, int limit) {
+    struct __rsh* r = __rsh_get();
+    struct __job_group* g = r->group_buffer;
+
+    while (g != NULL && strcmp(g->name, name) != 0) {
+        g = g->next;
+    }
+
+    if (g == NULL) {
+        g = malloc(sizeof(struct __job_group));
+        g->name = strdup(name);
+        g->limit = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        g->next = r->group_buffer;
+        r->group_buffer = g;
+    }
+
+    if (limit > 0) {
+        g->limit = limit;
+    }
+
+    return g;
+}
+
+//Helper function to count the running jobs of a group
+int __group_running(const char* name) {
+    struct __rsh* r = __rsh_get();
+    int count = 0;
+
+    for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+        if (j->group != NULL && j->status == JOB_RUNNING && strcmp(j->group, name) == 0) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+//Helper function to run one iteration of the event loop, dispatching every ready watcher, returns 1 once fd is
+//readable, 0 if only watchers fired or the timeout expired, and -1 if a signal interrupted the wait
+int __event_wait(int fd, int timeout) {
+    struct __rsh* r = __rsh_get();
+    struct pollfd fds[MAX_WATCHERS + 1];
+    struct __watcher active[MAX_WATCHERS];
+    int count = r->watcher_count;
+
+    //Callbacks may add or remove watchers, dispatch from a snapshot
+    memcpy(active, r->watchers, count * sizeof(struct __watcher));
+
+    for (int i = 0; i < count; i++) {
+        fds[i].fd = active[i].fd;
+        fds[i].events = active[i].events;
+        fds[i].revents = 0;
+    }
+
+    int total = count;
+    if (fd >= 0) {
+        fds[total].fd = fd;
+        fds[total].events = POLLIN;
+        fds[total].revents = 0;
+        total++;
+    }
+
+    int res = poll(fds, total, timeout);
+
+    if (res <= 0) {
+        return res;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (fds[i].revents != 0) {
+            active[i].callback(active[i].fd, fds[i].revents, active[i].data);
+        }
+    }
+
+    return (fd >= 0 && fds[count].revents != 0) ? 1 : 0;
+}
+
+//Helper function to wait up to timeout milliseconds for stdin to become readable, watchers that fire meanwhile are
+//dispatched without cutting the wait short, returns false once the full timeout passed without input
+bool __event_wait_input(int timeout) {
+    struct timespec start;
+    struct timespec now;
+    int left = timeout;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (__event_wait(STDIN_FILENO, left) != 1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+
+        if (elapsed >= timeout) {
+            return false;
+        }
+
+        left = timeout - elapsed;
+    }
+
+    return true;
+}
+
+//Helper function to append one JSON line describing the command that just finished to the metrics sink
+void __emit_metrics(const char* command) {
+    struct __rsh* r = __rsh_get();
+
+    if (r->metrics == NULL) {
+        return;
+    }
+
+    //Convert the monotonic spawn time to wall clock time for the record
+    struct timespec now_mono;
+    struct timespec now_real;
+    clock_gettime(CLOCK_MONOTONIC, &now_mono);
+    clock_gettime(CLOCK_REALTIME, &now_real);
+
+    double start = (now_real.tv_sec - (now_mono.tv_sec - r->last_start.tv_sec)) +
+                   (now_real.tv_nsec - (now_mono.tv_nsec - r->last_start.tv_nsec)) / 1e9;
+    double duration = (r->last_end.tv_sec - r->last_start.tv_sec) * 1e3 + (r->last_end.tv_nsec - r->last_start.tv_nsec) / 1e6;
+
+    char cwd[PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+
+    char command_json[PATH_LENGTH * 2];
+    char cwd_json[PATH_LENGTH * 2];
+    __json_escape(command_json, sizeof(command_json), r->current_command != NULL ? r->current_command : command);
+    __json_escape(cwd_json, sizeof(cwd_json), cwd);
+
+    struct rusage* u = &r->last_usage;
+    char line[PATH_LENGTH * 5];
+    int length = snprintf(line, sizeof(line),
+        "{\"start\":%.6f,\"duration_ms\":%.3f,\"command\":\"%s\",\"exit\":%d,\"stages\":%d,\"cwd\":\"%s\","
+        "\"user_ms\":%.3f,\"sys_ms\":%.3f,\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+        start, duration, command_json, r->last_status, r->last_stages, cwd_json,
+        u->ru_utime.tv_sec * 1e3 + u->ru_utime.tv_usec / 1e3, u->ru_stime.tv_sec * 1e3 + u->ru_stime.tv_usec / 1e3,
+        u->ru_maxrss, u->ru_minflt, u->ru_majflt, u->ru_nvcsw, u->ru_nivcsw);
+
+    if (length > 0 && (size_t) length < sizeof(line)) {
+        __writer_append(r->metrics, line, length);
+    }
+}
+
+//Helper function to make sure the executable index matches the path directories, checked at most once per prompt
+//so completing never costs more than one stat per directory, and rebuilt only when a directory changed
+void __exec_index_refresh(void) {
+    struct __rsh* r = __rsh_get();
+
+    if (r->exec_index_checked) {
+        return;
+    }
+
+    r->exec_index_checked = true;
+
+    //Compare the directory mtimes against the ones the index was built with
+    bool stale = (r->exec_index.count == 0);
+    char* path_copy = strdup(r->path);
+    int dir_count = 0;
+
+    for (char* save = NULL, *dir = strtok_r(path_copy, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+        struct stat st;
+
+        if (dir_count >= r->path_dir_count || strcmp(r->path_dirs[dir_count].path, dir) != 0 || stat(dir, &st) != 0 ||
+            st.st_mtim.tv_sec != r->path_dirs[dir_count].mtime.tv_sec ||
+            st.st_mtim.tv_nsec != r->path_dirs[dir_count].mtime.tv_nsec) {
+            stale = true;
+        }
+
+        dir_count++;
+    }
+
+    stale |= (dir_count != r->path_dir_count);
+    free(path_copy);
+
+    if (!stale) {
+        return;
+    }
+
+    //Rebuild from scratch, the BK-tree follows on the next unknown command
+    __trie_clear(&r->exec_index);
+    __bk_clear(&r->command_tree);
+
+    for (int i = 0; i < r->path_dir_count; i++) {
+        free(r->path_dirs[i].path);
+    }
+
+    free(r->path_dirs);
+    r->path_dirs = malloc((dir_count + 1) * sizeof(struct __path_dir));
+    r->path_dir_count = 0;
+
+    for (int i = 0; builtin_names[i] != NULL; i++) {
+        __trie_insert(&r->exec_index, builtin_names[i], 0);
+    }
+
+    path_copy = strdup(r->path);
+
+    for (char* save = NULL, *dir = strtok_r(path_copy, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+        struct __path_dir* entry = &r->path_dirs[r->path_dir_count++];
+        struct stat st;
+
+        entry->path = strdup(dir);
+        memset(&entry->mtime, 0, sizeof(entry->mtime));
+
+        //The mtime is taken before reading, a change during the scan triggers another rebuild later
+        if (stat(dir, &st) == 0) {
+            entry->mtime = st.st_mtim;
+        }
+
+        DIR* d = opendir(dir);
+        if (d == NULL) {
+            continue;
+        }
+
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR) {
+                continue;
+            }
+
+            if (fstatat(dirfd(d), de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+                __trie_insert(&r->exec_index, de->d_name, 0);
+            }
+        }
+
+        closedir(d);
+    }
+
+    free(path_copy);
+}
+
+//Helper function to replace a forked child with the requested command, builtins that are safe to run
+//outside the shell process are dispatched here, so they work both standalone and as pipeline stages
+void __exec_command(char** argv) {
+    int argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+
+    if (argc == 0) {
+        _exit(0);
+    }
+
+    //The shell's SIGCHLD handler is of no use to builtins running here
+    signal(SIGCHLD, SIG_DFL);
+
+    __trace(TRACE_EXEC, getpid(), 0, argv[0]);
+
+    if (strcmp(argv[0], "xargs") == 0) {
+        fflush(stdout);
+        _exit(__xargs(argc, argv));
+    }
+
+    else if (strcmp(argv[0], "tasks") == 0) {
+        fflush(stdout);
+        _exit(__tasks(argc, argv));
+    }
+
+    //Execute command directly using execvp
+    execvp(argv[0], argv);
+
+    //If execvp returns, there was an error
+    perror("execvp failed");
+    _exit(127); //Use status 127 for "command not found"
+}
+
+//Helper function to fork, recording the spawn in the execution trace
+pid_t __fork_traced(const char* command) {
+    pid_t pid = fork();
+
+    if (pid > 0) {
+        __trace(TRACE_SPAWN, pid, 0, command);
+    }
+
+    return pid;
+}
+
+//Helper function to dump the execution trace when the shell crashes, then let the signal terminate it
+void __handle_crash(int sig) {
+    const char* header = "\r\nrsh: fatal signal, execution trace follows\r\n";
+    write(STDERR_FILENO, header, strlen(header));
+
+    __trace_dump(STDERR_FILENO, "\r\n");
+
+    //The handler was installed with SA_RESETHAND, so this terminates with the original signal
+    raise(sig);
+}
+
+//Agnostic of whether its caused by a signal or byte, the program needs to exit
+void __handle_ctrlc(int sig) {
+    //Get handle of rsh datastructure
+    struct __rsh* r = __rsh_get();
+
+    if (r->running_process != 0) {
+        kill(r->running_process, SIGINT);
+    }
+
+    //A forked helper only ends itself, the writer and worker threads it would join and the files it would flush
+    //belong to the shell
+    else if (getpid() != event_loop_pid) {
+        if (sig == 0) {
+            fflush(stdout);
+        }
+        _exit((sig != 0) ? 128 + sig : 0);
+    }
+
+    //The teardown takes locks and joins threads, so a signal only wakes the event loop, which exits from there
+    else if (sig != 0) {
+        int saved_errno = errno;
+        char byte = 0;
+        write(r->sigint_pipe[1], &byte, 1);
+        errno = saved_errno;
+    }
+
+    else {
+        printf("\r\n");
+
+        //Destroy RSH struct
+        __rsh_destroy(rsh);
+        exit(0);
+    }
+}
+
+//Helper function to handle ctrl+z
+void __handle_ctrlz(int sig) {
+    struct __rsh* r = __rsh_get();
+    if (r->running_process != 0) {
+        kill(r->running_process, SIGTSTP);
+        int status;
+        waitpid(r->running_process, &status, WUNTRACED);
+        if (WIFSTOPPED(status)) {
+            __append_job(r->running_process, "command", JOB_STOPPED); //Store actual command
+        }
+        r->running_process = 0;
+    }
+}
+
+//Helper function to turn SIGCHLD into a byte on the self-pipe, so poll in the event loop wakes up
+void __handle_sigchld(int sig) {
+    if (getpid() != event_loop_pid) {
+        return;
+    }
+
+    int saved_errno = errno;
+    char byte = 0;
+    write(rsh->sigchld_pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+
+//Helper function to turn SIGWINCH into a byte on its self-pipe
+void __handle_sigwinch(int sig) {
+    if (getpid() != event_loop_pid) {
+        return;
+    }
+
+    int saved_errno = errno;
+    char byte = 0;
+    write(rsh->winch_pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+
+//Helper function to let CTRL+C break out of the wait builtin instead of exiting the shell
+void __handle_wait_interrupt(int sig) {
+    wait_interrupted = 1;
+}
+
+//Helper function to write src as the body of a JSON string into dst, truncating to fit, returns the length written
+size_t __json_escape(char* dst, size_t cap, const char* src) {
+    size_t len = 0;
+
+    for (const unsigned char* c = (const unsigned char*) src; *c != '\0'; c++) {
+        char escaped[8];
+        int n;
+
+        if (*c == '"' || *c == '\\') {
+            n = snprintf(escaped, sizeof(escaped), "\\%c", *c);
+        }
+
+        else if (*c < 0x20) {
+            n = snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+        }
+
+        else {
+            escaped[0] = (char) *c;
+            n = 1;
+        }
+
+        if (len + n + 1 > cap) {
+            break;
+        }
+
+        memcpy(dst + len, escaped, n);
+        len += n;
+    }
+
+    dst[len] = '\0';
+    return len;
+}
+
+//Helper function to determine if input is valid
+int __handle_input(int argc, char** argv, char* raw_input) {
+    //Get handle of rsh datastructure
+    struct __rsh* r = __rsh_get();
+
+    //Record the command as the shell is about to run it
+    if (trace_ring != NULL && trace_ring->enabled) {
+        char line[TRACE_TEXT];
+        size_t length = 0;
+        line[0] = '\0';
+
+        for (int i = 0; i < argc && length + 1 < sizeof(line); i++) {
+            length += snprintf(line + length, sizeof(line) - length, (i > 0) ? " %s" : "%s", argv[i]);
+        }
+
+        __trace(TRACE_COMMAND, getpid(), 0, line);
+    }
+
+    //Handle empty command - Should come first
+    if (argc == 0 || argv[0] == NULL) {
+        return -1;
+    }
+
+    //Time keyword, runs the rest of the line and reports its resource usage even for builtins
+    else if (strcmp(argv[0], "time") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Usage: time command [args...]\r\n");
+            return -1;
+        }
+
+        char* rest = strstr(raw_input, "time") + strlen("time");
+        while (*rest == ' ' || *rest == '\t') {
+            rest++;
+        }
+
+        r->time_next = true;
+        memset(&r->last_usage, 0, sizeof(struct rusage));
+        clock_gettime(CLOCK_MONOTONIC, &r->last_start);
+
+        int res = __handle_input(argc - 1, argv + 1, rest);
+
+        //Nothing was spawned, report the wall time of the builtin
+        if (r->time_next) {
+            clock_gettime(CLOCK_MONOTONIC, &r->last_end);
+            __report_usage(argv[1], true);
+        }
+
+        return res;
+    }
+
+    //Exit command
+    else if (strcmp(argv[0], "exit") == 0) {
+        __handle_ctrlc(0);
+    }
+
+    else if (strcmp(argv[0], "clear")  == 0) {
+        //-s also drops the scrollback
+        __clear_screen(argc > 1 && strcmp(argv[1], "-s") == 0);
+        return 0;
+    }
+
+    //Handle job-control commands
+    else if (strcmp(argv[0], "jobs") == 0) {
+        __reap_jobs();
+
+        struct __job_node* j = r->job_buffer;
+        while (j) {
+            if (j->status != JOB_DONE) {
+                const char* state = (j->status == JOB_STOPPED) ? "Stopped" : (j->status == JOB_QUEUED) ? "Queued" : "Running";
+                printf("[%d] %d %s\t%s\r\n", j->id, j->pid, state, j->command);
+            }
+            j = j->next;
+        }
+
+        //Finished jobs are reported once, then forgotten
+        __notify_jobs();
+        return 0;
+    }
+
+    else if (strcmp(argv[0], "fg") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Usage: fg <pid|%%job>\r\n");
+            return -1;
+        }
+
+        struct __job_node* job = __find_job(argv[1]);
+        if (job == NULL || job->pid == 0) {
+            fprintf(stderr, "fg: no such job %s\r\n", argv[1]);
+            return -1;
+        }
+
+        //A job reaped in the background only has its status left to report
+        if (job->status == JOB_DONE) {
+            int code = job->exit_status;
+            printf("[%d] Done\t%s\r\n", job->id, job->command);
+            __remove_job(job->pid);
+            return code;
+        }
+
+        pid_t pid = job->pid;
+
+        //A job that stopped gets the terminal modes it had back
+        if (job->has_modes) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->modes);
+        }
+
+        //Ned to ignore SIGTTOU when transferring group
+        signal(SIGTTOU, SIG_IGN);
+        tcsetpgrp(STDIN_FILENO, pid);
+        signal(SIGTTOU, SIG_DFL);
+
+        //Signal entire process group
+        kill(-pid, SIGCONT);
+
+        int status;
+        __wait_foreground(&pid, &status, 1);
+
+        signal(SIGTTOU, SIG_IGN);
+        tcsetpgrp(STDIN_FILENO, getpid());
+
+        if (WIFSTOPPED(status)) {
+            job->has_modes = (tcgetattr(STDIN_FILENO, &job->modes) == 0);
+        }
+
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
+        signal(SIGTTOU, SIG_DFL);
+
+        //A job that ran to the end in the foreground is not reported as done later
+        if (WIFSTOPPED(status)) {
+            __update_job(pid, status);
+            return 0;
+        }
+
+        __remove_job(pid);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    else if (strcmp(argv[0], "bg") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Usage: bg <pid|%%job>\r\n");
+            return -1;
+        }
+
+        struct __job_node* job = __find_job(argv[1]);
+        if (job == NULL || job->pid == 0) {
+            fprintf(stderr, "bg: no such job %s\r\n", argv[1]);
+            return -1;
+        }
+
+        //Resume in background, the job stays in the table until it is reaped
+        kill(-job->pid, SIGCONT);
+        job->status = JOB_RUNNING;
+        return 0;
+    }
+
+    else if (strcmp(argv[0], "sem") == 0 || strcmp(argv[0], "jobqueue") == 0) {
+        return __sem(argc, argv, raw_input);
+    }
+
+    else if (strcmp(argv[0], "wait") == 0) {
+        return __wait(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "set") == 0) {
+        return __set(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "perfstat") == 0) {
+        return __perfstat(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "stats") == 0) {
+        return __stats(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "trace") == 0) {
+        return __trace_builtin(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "cd") == 0) {
+        return __cd(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "z") == 0) {
+        return __z(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "joblog") == 0) {
+        return __joblog(argc, argv);
+    }
+
+    else if (strcmp(argv[0], "record") == 0) {
+        return __record(argc, argv);
+    }
+
+    //Trailing & outside quotes runs the command line as a background job
+    char* amp = __background_marker(raw_input);
+    if (amp != NULL) {
+        *amp = '\0';
+
+        while (amp > raw_input && (amp[-1] == ' ' || amp[-1] == '\t')) {
+            *--amp = '\0';
+        }
+
+        struct __job_node* job = __launch_background(raw_input, NULL);
+        if (job == NULL) {
+            return -1;
+        }
+
+        printf("[%d] %d\r\n", job->id, job->pid);
+        return 0;
+    }
+
+    int pipe_count = 0;
+    char*** commands = __parse_pipeline(raw_input, &pipe_count);
+
+    if (pipe_count > 1) {
+        //Every stage must name a known command before any of them is started
+        for (int i = 0; i < pipe_count; i++) {
+            if (commands[i][0] != NULL && !__command_exists(commands[i][0])) {
+                __command_not_found(commands[i][0]);
+                r->last_status = 127;
+
+                for (int j = 0; j < pipe_count; j++) {
+                    for (int k = 0; commands[j][k] != NULL; free(commands[j][k++]));
+                    free(commands[j]);
+                }
+
+                free(commands);
+                return -2;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &r->last_start);
+        int res = __handle_pipeline(commands, pipe_count);
+        __command_finished(commands[0][0], r->time_next);
+
+        //Cleanup commands array
+        for (int i = 0; i < pipe_count; i++) {
+            for (int j = 0; commands[i][j] != NULL; j++) {
+                free(commands[i][j]);
+            }
+
+            free(commands[i]);
+        }
+
+        free(commands);
+        return res;
+    }
+
+    //History function
+    if (!strcmp(argv[0], "history") || !strcmp(argv[0], "History")) {
+        __display_history();
+        return 0;
+    }
+
+    //Unknown commands are reported without forking
+    if (!__command_exists(argv[0])) {
+        __command_not_found(argv[0]);
+        r->last_status = 127;
+        return -2;
+    }
+
+    //Fork to create child process
+    clock_gettime(CLOCK_MONOTONIC, &r->last_start);
+    pid_t id = __fork_traced(argv[0]);
+
+    //If in child process
+    if (id == 0) {
+        //Create new process group
+        setpgid(0, 0);
+
+        //Does not return
+        __exec_command(argv);
+    }
+
+    //Parent process
+    else if (id > 0) {
+        //Set child process ID
+        setpgid(id, id);
+
+        int status = __run_foreground(id, argv[0]);
+
+        if (!WIFSTOPPED(status)) {
+            __command_finished(argv[0], r->time_next);
+        }
+    }
+
+    else {
+        fprintf(stderr, "Error: Fork failed\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+//Helper fucntion for handling pipelining
+int __handle_pipeline(char*** commands, int num_commands) {
+    int prev_pipe[2];
+    int next_pipe[2];
+    pid_t pids[num_commands];
+
+    for (int i = 0; i < num_commands; i++) {
+        if (i < num_commands - 1) {
+            if (pipe(next_pipe) < 0) {
+                //Pipe failed, return with error
+                printf("Error (FATAL): Could not open pipe");
+                return -1;
+            }
+        }
+
+        pid_t pid = __fork_traced(commands[i][0]);
+
+        //Child process
+        if (pid == 0) {
+
+            //Sets up inputs
+            if(i > 0) {
+                dup2(prev_pipe[0], STDIN_FILENO);
+                close(prev_pipe[0]);
+                close(prev_pipe[1]);
+            }
+
+            //Sets up outputs
+            if (i < num_commands - 1) {
+                close(next_pipe[0]);
+                dup2(next_pipe[1], STDOUT_FILENO);
+                close(next_pipe[1]);
+            }
+
+            __exec_command(commands[i]);
+        }
+
+        else if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+
+        pids[i] = pid;
+
+        //If not first run, then close previous pipes
+        if (i > 0) {
+            close(prev_pipe[0]);
+            close(prev_pipe[1]);
+        }
+
+        if (i < num_commands - 1) {
+            prev_pipe[0] = next_pipe[0];
+            prev_pipe[1] = next_pipe[1];
+        }
+    }
+
+    //Stages are reaped in whatever order they finish, the pipeline reports the last one
+    int statuses[num_commands];
+    __wait_foreground(pids, statuses, num_commands);
+
+    return WEXITSTATUS(statuses[num_commands - 1]);
+}
+
+//Helper function to start a command line as a background job in its own process group
+struct __job_node* __launch_background(const char* command, const char* group) {
+    struct __rsh* r = __rsh_get();
+    char* line = strdup(command);
+    int capture[2] = {-1, -1};
+    struct __job_log* log = NULL;
+
+    //Logs of jobs still writing cannot be dropped, so once JOBLOG_KEEP of them are open new jobs are not captured
+    int live_logs = 0;
+
+    for (struct __job_log* l = r->job_logs; l != NULL; l = l->next) {
+        if (l->fd >= 0) {
+            live_logs++;
+        }
+    }
+
+    //With capture on the job writes into a pipe the event loop drains, it is watched before the job starts so a full
+    //watcher table leaves the job writing to the terminal instead of into a pipe nobody reads
+    if (r->capture_jobs && r->watcher_count < MAX_WATCHERS && live_logs < JOBLOG_KEEP) {
+        if (pipe2(capture, O_CLOEXEC) != 0) {
+            perror("pipe");
+            capture[0] = capture[1] = -1;
+        }
+
+        else {
+            log = malloc(sizeof(struct __job_log));
+            fcntl(capture[0], F_SETFL, O_NONBLOCK);
+
+            if (log == NULL || !__watch_fd(capture[0], POLLIN, __on_job_output, log)) {
+                close(capture[0]);
+                close(capture[1]);
+                capture[0] = capture[1] = -1;
+                free(log);
+                log = NULL;
+            }
+        }
+    }
+
+    pid_t pid = __fork_traced(command);
+
+    if (pid == 0) {
+        setpgid(0, 0);
+
+        if (capture[1] >= 0) {
+            dup2(capture[1], STDOUT_FILENO);
+            dup2(capture[1], STDERR_FILENO);
+        }
+
+        int pipe_count = 0;
+        char*** commands = __parse_pipeline(line, &pipe_count);
+
+        //Plain commands replace the child, pipelines need it to stay around as the group leader
+        if (pipe_count == 1) {
+            __exec_command(commands[0]);
+        }
+
+        _exit(__handle_pipeline(commands, pipe_count));
+    }
+
+    free(line);
+
+    if (capture[1] >= 0) {
+        close(capture[1]);
+    }
+
+    if (pid < 0) {
+        perror("fork");
+
+        if (log != NULL) {
+            __unwatch_fd(capture[0]);
+            close(capture[0]);
+            free(log);
+        }
+        return NULL;
+    }
+
+    setpgid(pid, pid);
+
+    struct __job_node* job = __append_job(pid, command, JOB_RUNNING);
+    if (group != NULL) {
+        job->group = strdup(group);
+    }
+
+    if (log != NULL) {
+        log->id = job->id;
+        log->pid = pid;
+        log->command = strdup(command);
+        log->fd = capture[0];
+        log->head = 0;
+        log->length = 0;
+        log->dropped = 0;
+        log->next = r->job_logs;
+        r->job_logs = log;
+
+        //Drop the oldest log whose job is done once there are too many, at most JOBLOG_KEEP are still open so one
+        //is always found
+        int kept = 0;
+        struct __job_log** link = &r->job_logs;
+        struct __job_log** oldest = NULL;
+
+        for (; *link != NULL; link = &(*link)->next) {
+            kept++;
+
+            if ((*link)->fd < 0) {
+                oldest = link;
+            }
+        }
+
+        if (kept > JOBLOG_KEEP && oldest != NULL) {
+            struct __job_log* gone = *oldest;
+            *oldest = gone->next;
+            __job_log_close(gone);
+            free(gone->command);
+            free(gone);
+        }
+    }
+
+    return job;
+}
+
+//Helper function to stop draining a job log, the output already captured stays
+void __job_log_close(struct __job_log* log) {
+    if (log->fd >= 0) {
+        __unwatch_fd(log->fd);
+        close(log->fd);
+        log->fd = -1;
+    }
+}
+
+//Event loop callback for a captured job's output, reads straight into the ring in chunks as large as the space up to
+//its end, and stops after a ring's worth so a chatty job cannot hold up the loop
+void __on_job_output(int fd, short revents, void* data) {
+    struct __job_log* log = data;
+    size_t taken = 0;
+
+    while (taken < JOBLOG_SIZE) {
+        ssize_t n = read(fd, log->data + log->head, JOBLOG_SIZE - log->head);
+
+        if (n > 0) {
+            log->head = (log->head + n) % JOBLOG_SIZE;
+
+            if (log->length + n > JOBLOG_SIZE) {
+                log->dropped += log->length + n - JOBLOG_SIZE;
+                log->length = JOBLOG_SIZE;
+            }
+
+            else {
+                log->length += n;
+            }
+
+            taken += n;
+            continue;
+        }
+
+        //End of file once the job and anything it started are gone
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            __job_log_close(log);
+        }
+
+        break;
+    }
+}
+
+//Builtin to show captured background job output, "joblog" lists the logs kept and "joblog %job" prints one
+int __joblog(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+
+    if (argc < 2) {
+        if (!r->capture_jobs && r->job_logs == NULL) {
+            printf("joblog: capture is off, enable it with 'set capture on'\r\n");
+            return 0;
+        }
+
+        for (struct __job_log* log = r->job_logs; log != NULL; log = log->next) {
+            printf("[%d] %d %s %zu bytes\t%s\r\n", log->id, log->pid, (log->fd >= 0) ? "Writing" : "Closed",
+                   log->length, log->command);
+        }
+
+        return 0;
+    }
+
+    //The most recent log of that job number, or the one of that pid
+    bool by_id = (argv[1][0] == '%');
+    int value = atoi(by_id ? argv[1] + 1 : argv[1]);
+    struct __job_log* log = r->job_logs;
+
+    while (log != NULL && !((by_id && log->id == value) || (!by_id && log->pid == value))) {
+        log = log->next;
+    }
+
+    if (log == NULL) {
+        fprintf(stderr, "joblog: no output captured for %s\r\n", argv[1]);
+        return -1;
+    }
+
+    if (log->dropped > 0) {
+        printf("(%lu earlier bytes dropped)\r\n", (unsigned long) log->dropped);
+    }
+
+    //Oldest bytes first, the ring is in at most two pieces
+    size_t start = (log->head + JOBLOG_SIZE - log->length) % JOBLOG_SIZE;
+    size_t first = (start + log->length > JOBLOG_SIZE) ? JOBLOG_SIZE - start : log->length;
+
+    fflush(stdout);
+    write(STDOUT_FILENO, log->data + start, first);
+    write(STDOUT_FILENO, log->data, log->length - first);
+
+    return 0;
+}
+
+//Helper function to report finished background jobs and drop them from the table
+void __notify_jobs(void) {
+    struct __rsh* r = __rsh_get();
+    struct __job_node* j = r->job_buffer;
+
+    while (j != NULL) {
+        struct __job_node* next = j->next;
+
+        if (j->status == JOB_DONE) {
+            printf("[%d] Done\t%s\r\n", j->id, j->command);
+            __remove_job(j->pid);
+        }
+
+        j = next;
+    }
+}
+
+//Event loop callback for the SIGINT self-pipe, the shell exits outside of the signal handler
+void __on_sigint(int fd, short revents, void* data) {
+    __handle_ctrlc(0);
+}
+
+//Event loop callback for the SIGCHLD self-pipe
+void __on_sigchld(int fd, short revents, void* data) {
+    char drain[64];
+    while (read(fd, drain, sizeof(drain)) > 0);
+
+    __reap_jobs();
+}
+
+//Event loop callback for the SIGWINCH self-pipe, picks up the new width and redraws a line being edited
+void __on_sigwinch(int fd, short revents, void* data) {
+    struct __rsh* r = __rsh_get();
+    char drain[64];
+
+    while (read(fd, drain, sizeof(drain)) > 0);
+
+    if (__update_term_width() && r->at_prompt) {
+        __redraw_line();
+    }
+}
+
+//Helper function to read the terminal width again, returns true if it changed, SIGWINCH only reaches the terminal's
+//foreground process group, so a resize while a command runs is picked up when the next prompt calls this
+bool __update_term_width(void) {
+    struct __rsh* r = __rsh_get();
+    struct winsize ws;
+
+    //While recording stdout is the pseudo terminal, which is brought up to date first
+    if (r->recorder != NULL) {
+        __record_sync_size(r->recorder);
+    }
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_col != r->term_width) {
+        r->term_width = ws.ws_col;
+        return true;
+    }
+
+    return false;
+}
+
+//Event loop callback for the listening control socket, while every watcher is taken connections are closed right away
+//rather than left in the backlog, which would keep waking the loop
+void __on_control_accept(int fd, short revents, void* data) {
+    int client_fd;
+
+    while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct __control_client* client = calloc(1, sizeof(struct __control_client));
+        client->fd = client_fd;
+
+        if (!__watch_fd(client_fd, POLLIN, __on_control_client, client)) {
+            close(client_fd);
+            free(client);
+        }
+    }
+}
+
+//Event loop callback for a control connection, reads the request line and then writes the response without blocking
+void __on_control_client(int fd, short revents, void* data) {
+    struct __control_client* client = data;
+
+    //Reading the request
+    if (client->response.data == NULL) {
+        ssize_t n = read(fd, client->request + client->request_length, CONTROL_REQUEST_SIZE - 1 - client->request_length);
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+
+        if (n <= 0 && client->request_length == 0) {
+            __control_close(client);
+            return;
+        }
+
+        client->request_length += (n > 0) ? n : 0;
+        client->request[client->request_length] = '\0';
+
+        //Wait for the full line unless the peer stopped sending or the buffer is full
+        char* newline = strpbrk(client->request, "\r\n");
+        if (newline == NULL && n > 0 && client->request_length < CONTROL_REQUEST_SIZE - 1) {
+            return;
+        }
+
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+
+        __control_answer(client->request, &client->response);
+
+        //Switch the watcher over to writing
+        __unwatch_fd(fd);
+        if (!__watch_fd(fd, POLLOUT, __on_control_client, client)) {
+            __control_close(client);
+        }
+        return;
+    }
+
+    ssize_t n = write(fd, client->response.data + client->sent, client->response.length - client->sent);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (n > 0) {
+        client->sent += n;
+    }
+
+    if (n <= 0 || client->sent >= client->response.length) {
+        __control_close(client);
+    }
+}
+
+//Helper function to insert text into the input line at the cursor, returns false when it does not fit
+static bool __insert_at(char* buffer, size_t* length, size_t* cursor, const char* text, size_t count) {
+    if (*length + count > PATH_LENGTH - 1) {
+        return false;
+    }
+
+    memmove(buffer + *cursor + count, buffer + *cursor, *length - *cursor);
+    memcpy(buffer + *cursor, text, count);
+    *cursor += count;
+    *length += count;
+    return true;
+}
+
+//Helper function to advance the escape sequence decoder by one byte, returns the key it completes or KEY_NONE while
+//a sequence is still open, plain bytes come straight out
+int __decode_key(struct __key_decoder* d, unsigned char byte) {
+    switch (d->state) {
+        case DECODE_ESC:
+            d->param_length = 0;
+
+            if (byte == '[' || byte == 'O') {
+                d->state = (byte == '[') ? DECODE_CSI : DECODE_SS3;
+                return KEY_NONE;
+            }
+
+            //Alt+b and Alt+f move by words, anything else after a lone ESC is taken as typed
+            d->state = DECODE_GROUND;
+            return (byte == 'b') ? KEY_WORD_LEFT : (byte == 'f') ? KEY_WORD_RIGHT : byte;
+
+        case DECODE_CSI:
+            //Parameter and intermediate bytes, then a final byte ends the sequence
+            if (byte >= 0x20 && byte <= 0x3f) {
+                if (d->param_length + 1 < (int) sizeof(d->params)) {
+                    d->params[d->param_length++] = byte;
+                }
+                return KEY_NONE;
+            }
+            // fall through
+
+        case DECODE_SS3: {
+            char introducer = (d->state == DECODE_CSI) ? '[' : 'O';
+            d->params[d->param_length] = '\0';
+            d->state = DECODE_GROUND;
+
+            for (size_t i = 0; i < sizeof(key_table) / sizeof(key_table[0]); i++) {
+                if (key_table[i].introducer == introducer && key_table[i].final == byte && strcmp(key_table[i].params, d->params) == 0) {
+                    return key_table[i].key;
+                }
+            }
+
+            return KEY_UNKNOWN;
+        }
+
+        default:
+            if (byte == 0x1b) {
+                d->state = DECODE_ESC;
+                return KEY_NONE;
+            }
+
+            return byte;
+    }
+}
+
+//Helper function to get input from user
+char** __parse_input(int* argc, char** input_ptr) {
+    struct __rsh* r = __rsh_get();
+
+    //Initialize command variables - input can be as long as path length
+    *input_ptr = malloc(PATH_LENGTH * sizeof(char));
+
+    if (*input_ptr == NULL) {
+        perror("Failed to allocate memory for input");
+        return NULL;
+    }
+
+    char* input = *input_ptr;
+    size_t input_len = 0;
+    size_t cursor = 0;
+    bool repeated_tab = false;
+    bool done = false;
+
+    //Bytes of a multi-byte character still being typed, it is inserted once complete
+    char glyph[4];
+    int glyph_length = 0;
+    int glyph_need = 0;
+
+    //History browsing, hist_pos is hist_count while editing a new line, which is kept aside meanwhile
+    uint32_t hist_pos = r->hist_count;
+    char saved[PATH_LENGTH];
+    size_t saved_len = 0;
+
+    //Path directories are checked again on the first completion of this prompt
+    r->exec_index_checked = false;
+
+    //Raw mode only while the line is edited, keeping input typed ahead during the last command
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios);
+
+    //Prompt user for input, slow segments are refreshed in the background and redraw the prompt when they change
+    __update_term_width();
+    __prompt_request();
+    __draw_prompt();
+    __reset_line();
+    r->at_prompt = true;
+
+    //Read input in bursts, every key waiting is applied before the line is redrawn once
+    while (!done) {
+        unsigned char burst[KEY_BURST];
+        ssize_t count = 0;
+        int waiting = 0;
+
+        //Service background events until a key arrives
+        if (__event_wait(STDIN_FILENO, -1) <= 0) {
+            continue;
+        }
+
+        //Whatever follows Enter is typeahead for the command the line runs, so bytes are taken one at a time and
+        //reading stops at the Enter, the burst is only as long as the input already waiting
+        if (ioctl(STDIN_FILENO, FIONREAD, &waiting) != 0 || waiting < 1) {
+            waiting = 1;
+        }
+
+        ssize_t n = 1;
+        while (count < waiting && count < KEY_BURST && (n = read(STDIN_FILENO, burst + count, 1)) > 0) {
+            count++;
+
+            if (burst[count - 1] == '\r' || burst[count - 1] == '\n') {
+                break;
+            }
+        }
+
+        //If read cannot occur
+        if (count == 0 && n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                //Signal interrupted read, restart
+                continue;
+            }
+
+            perror("Error (FATAL): Cannot read from stdin");
+            return NULL;
+        }
+
+        if (r->recorder != NULL) {
+            __record_event(r->recorder, 'i', (const char*) burst, count);
+        }
+
+        for (ssize_t i = 0; i < count && !done; i++) {
+            //Printable ASCII runs, such as pasted text, go in at once
+            if (r->decoder.state == DECODE_GROUND) {
+                size_t run = __ascii_prefix((const char*) burst + i, count - i);
+
+                if (run > 1 && __insert_at(input, &input_len, &cursor, (const char*) burst + i, run)) {
+                    glyph_length = 0;
+                    repeated_tab = false;
+                    i += run - 1;
+                    continue;
+                }
+            }
+
+            int key = __decode_key(&r->decoder, burst[i]);
+
+            //A lone ESC at the end of a burst is a key of its own if nothing follows shortly
+            if (key == KEY_NONE && i + 1 == count && r->decoder.state == DECODE_ESC &&
+                !__event_wait_input(KEY_ESC_TIMEOUT)) {
+                r->decoder.state = DECODE_GROUND;
+                key = KEY_ESCAPE;
+            }
+
+            if (key == KEY_NONE) {
+                continue;
+            }
+
+            //A second TAB in a row lists the candidates
+            bool tab = (key == '\t');
+
+            switch (key) {
+                //Newline (Enter Key) - Could be \n or \r, always the last byte read
+                case '\n':
+                case '\r':
+                    done = true;
+                    break;
+
+                //Handle backspace
+                case '\b':
+                case 127:
+                    if (cursor > 0) {
+                        size_t start = __grapheme_floor(input, input_len, cursor - 1);
+                        memmove(input + start, input + cursor, input_len - cursor);
+                        input_len -= cursor - start;
+                        cursor = start;
+                    }
+                    break;
+
+                case KEY_DELETE:
+                    if (cursor < input_len) {
+                        size_t end = __next_grapheme(input, input_len, cursor, NULL);
+                        memmove(input + cursor, input + end, input_len - end);
+                        input_len -= end - cursor;
+                    }
+                    break;
+
+                //The cursor moves over whole characters, combining marks included
+                case KEY_LEFT:
+                    if (cursor > 0) {
+                        cursor = __grapheme_floor(input, input_len, cursor - 1);
+                    }
+                    break;
+
+                //At the end of the line the right arrow and CTRL+F accept the suggestion
+                case KEY_RIGHT:
+                case 0x06:
+                    if (cursor < input_len) {
+                        cursor = __next_grapheme(input, input_len, cursor, NULL);
+                    }
+
+                    else {
+                        const char* suggestion = __history_suggest(input, input_len);
+
+                        if (suggestion != NULL) {
+                            __complete_insert(input, &input_len, suggestion + input_len, strlen(suggestion) - input_len);
+                            cursor = input_len;
+                        }
+                    }
+                    break;
+
+                case KEY_HOME:
+                case 0x01:
+                    cursor = 0;
+                    break;
+
+                case KEY_END:
+                case 0x05:
+                    cursor = input_len;
+                    break;
+
+                case KEY_WORD_LEFT:
+                    while (cursor > 0 && input[cursor - 1] == ' ') {
+                        cursor--;
+                    }
+                    while (cursor > 0 && input[cursor - 1] != ' ') {
+                        cursor--;
+                    }
+                    break;
+
+                case KEY_WORD_RIGHT:
+                    while (cursor < input_len && input[cursor] == ' ') {
+                        cursor++;
+                    }
+                    while (cursor < input_len && input[cursor] != ' ') {
+                        cursor++;
+                    }
+                    break;
+
+                //CTRL+U and CTRL+K cut before and after the cursor
+                case 0x15:
+                    memmove(input, input + cursor, input_len - cursor);
+                    input_len -= cursor;
+                    cursor = 0;
+                    break;
+
+                case 0x0b:
+                    input_len = cursor;
+                    break;
+
+                //CTRL+W cuts the word before the cursor
+                case 0x17: {
+                    size_t start = cursor;
+                    while (start > 0 && input[start - 1] == ' ') {
+                        start--;
+                    }
+                    while (start > 0 && input[start - 1] != ' ') {
+                        start--;
+                    }
+
+                    memmove(input + start, input + cursor, input_len - cursor);
+                    input_len -= cursor - start;
+                    cursor = start;
+                    break;
+                }
+
+                //Walk through history, the line being written is restored when walking past the newest entry
+                case KEY_UP:
+                case KEY_DOWN:
+                    if (key == KEY_UP && hist_pos > 0) {
+                        if (hist_pos == r->hist_count) {
+                            memcpy(saved, input, input_len);
+                            saved_len = input_len;
+                        }
+
+                        hist_pos--;
+                    }
+
+                    else if (key == KEY_DOWN && hist_pos < r->hist_count) {
+                        hist_pos++;
+                    }
+
+                    else {
+                        break;
+                    }
+
+                    if (hist_pos == r->hist_count) {
+                        memcpy(input, saved, saved_len);
+                        input_len = saved_len;
+                    }
+
+                    else {
+                        input_len = strnlen(r->hist_entries[hist_pos], PATH_LENGTH - 1);
+                        memcpy(input, r->hist_entries[hist_pos], input_len);
+                    }
+
+                    cursor = input_len;
+                    break;
+
+                //Complete the word before the cursor, text after the cursor is kept behind the completion
+                case '\t': {
+                    char tail[PATH_LENGTH];
+                    size_t tail_len = input_len - cursor;
+                    memcpy(tail, input + cursor, tail_len);
+
+                    size_t completed = __complete(input, cursor, repeated_tab);
+
+                    if (completed + tail_len < PATH_LENGTH) {
+                        memcpy(input + completed, tail, tail_len);
+                        input_len = completed + tail_len;
+                        cursor = completed;
+                    }
+
+                    else {
+                        memcpy(input + cursor, tail, tail_len);
+                    }
+                    break;
+                }
+
+                //CTRL+L clears the screen and puts the prompt and the line back at the top
+                case 0x0c:
+                    __clear_screen(false);
+                    __draw_prompt();
+                    __reset_line();
+                    break;
+
+                //Handle CTRL+C
+                case 0x03:
+                    __handle_ctrlc(0);
+                    break;
+
+                default:
+                    //Other control characters and unknown sequences are ignored
+                    if (key >= 0x100 || key < 0x20 || key == 0x7f) {
+                        break;
+                    }
+
+                    //Multi-byte characters are gathered until complete, stray or malformed bytes are dropped
+                    if (key >= 0x80) {
+                        if ((key & 0xc0) != 0x80) {
+                            glyph_need = (key >= 0xc2 && key <= 0xdf) ? 2 : (key >= 0xe0 && key <= 0xef) ? 3 :
+                                         (key >= 0xf0 && key <= 0xf4) ? 4 : 0;
+                            glyph_length = 0;
+                        }
+
+                        if (glyph_need == 0 || ((key & 0xc0) == 0x80 && glyph_length == 0)) {
+                            break;
+                        }
+
+                        glyph[glyph_length++] = (char) key;
+                        if (glyph_length < glyph_need) {
+                            break;
+                        }
+
+                        uint32_t code;
+                        int size = glyph_length;
+                        glyph_length = 0;
+
+                        if (__utf8_decode(glyph, size, &code) != size) {
+                            break;
+                        }
+
+                        if (!__insert_at(input, &input_len, &cursor, glyph, size)) {
+                            //Input buffer is full
+                            printf("\r\nInput too long! Maximum length is %d\r\n", PATH_LENGTH - 1);
+                            done = true;
+                        }
+                        break;
+                    }
+
+                    glyph_length = 0;
+                    char c = (char) key;
+
+                    //Not a control character, add to the input buffer at the cursor, the redraw echoes it
+                    if (!__insert_at(input, &input_len, &cursor, &c, 1)) {
+                        //Input buffer is full
+                        printf("\r\nInput too long! Maximum length is %d\r\n", PATH_LENGTH - 1);
+                        done = true;
+                    }
+                    break;
+            }
+
+            repeated_tab = tab;
+        }
+
+        if (done) {
+            break;
+        }
+
+        __refresh_line(input, input_len, cursor, true);
+    }
+
+    //Show the whole line without the suggestion before the command's output
+    input[input_len] = '\0';
+    __refresh_line(input, input_len, input_len, false);
+
+    //A line that filled its last row already moved the cursor to the next one
+    printf((r->ansi && r->view.place > 0 && r->view.place % r->term_width == 0) ? "\r" : "\r\n");
+    r->at_prompt = false;
+
+    //The command gets the terminal with the modes it started with, so its output needs no translation
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
+
+    //Add command to history
+    __append_history(input);
+
+    return __tokenize_input(input, argc);
+}
+
+//Helper function to record an event into the trace ring, it only touches shared memory so it is cheap enough for
+//every spawn and reap, and safe to call from a forked child right before exec
+void __trace(int type, pid_t pid, int status, const char* text) {
+    if (trace_ring == NULL || !trace_ring->enabled) {
+        return;
+    }
+
+    uint64_t index = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+    struct __trace_event* e = &trace_ring->events[index % TRACE_EVENTS];
+    struct timespec now;
+
+    __atomic_store_n(&e->sequence, 0, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    e->time = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    e->pid = pid;
+    e->type = type;
+    e->status = status;
+
+    if (text != NULL) {
+        strncpy(e->text, text, TRACE_TEXT - 1);
+        e->text[TRACE_TEXT - 1] = '\0';
+    }
+
+    else {
+        e->text[0] = '\0';
+    }
+
+    __atomic_store_n(&e->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+//Builtin to inspect the execution trace, "trace" prints it, "trace <file>" writes it to a file, "trace -c" clears it
+int __trace_builtin(int argc, char** argv) {
+    if (trace_ring == NULL) {
+        fprintf(stderr, "trace: tracing was never enabled, use set -x\r\n");
+        return -1;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        for (int i = 0; i < TRACE_EVENTS; i++) {
+            trace_ring->events[i].sequence = 0;
+        }
+
+        trace_ring->head = 0;
+        return 0;
+    }
+
+    if (argc > 1) {
+        int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            perror(argv[1]);
+            return -1;
+        }
+
+        __trace_dump(fd, "\n");
+        close(fd);
+        return 0;
+    }
+
+    fflush(stdout);
+    __trace_dump(STDOUT_FILENO, isatty(STDOUT_FILENO) ? "\r\n" : "\n");
+    return 0;
+}
+
+//Helper function to write the trace, oldest event first, with times relative to the oldest event, also used by the
+//crash handler so lines are put together by __trace_field in a stack buffer and only write is called
+void __trace_dump(int fd, const char* newline) {
+    const char* names[] = {"command", "spawn", "exec", "reap"};
+    uint64_t head = __atomic_load_n(&trace_ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+    uint64_t base = 0;
+
+    for (uint64_t i = first; i < head; i++) {
+        struct __trace_event* e = &trace_ring->events[i % TRACE_EVENTS];
+
+        //Skip entries that are being written or were already overwritten
+        if (__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+
+        if (base == 0) {
+            base = e->time;
+        }
+
+        //Same layout as "%12.3fms %7d %-8s ", the time is kept in whole microseconds
+        char line[TRACE_TEXT + 96];
+        uint64_t micros = (e->time - base) / 1000;
+        size_t length = __trace_field(line, NULL, micros / 1000, 8, ' ');
+        length += __trace_field(line + length, ".", micros % 1000, 3, '0');
+        length += __trace_field(line + length, "ms ", e->pid, 7, ' ');
+        length += __trace_field(line + length, " ", 0, 0, 0);
+        length += __trace_field(line + length, names[e->type], 0, -8, ' ');
+        length += __trace_field(line + length, " ", 0, 0, 0);
+
+        if (e->type == TRACE_REAP) {
+            int code = WIFSTOPPED(e->status) ? WSTOPSIG(e->status) : WIFEXITED(e->status) ? WEXITSTATUS(e->status) :
+                       WIFSIGNALED(e->status) ? 128 + WTERMSIG(e->status) : -1;
+
+            length += __trace_field(line + length, WIFSTOPPED(e->status) ? "stopped " : "status ", 0, 0, 0);
+            length += __trace_field(line + length, (code < 0) ? "-" : NULL, (code < 0) ? -code : code, 1, ' ');
+        }
+
+        else {
+            length += __trace_field(line + length, e->text, 0, 0, 0);
+        }
+
+        length += __trace_field(line + length, newline, 0, 0, 0);
+        write(fd, line, length);
+    }
+}
+
+//Helper function to format part of a trace line without touching the heap or locale, safe inside a signal handler,
+//writes text followed by value in at least width digits padded with pad, a negative width pads the text on the
+//right instead and writes no number, a width of 0 writes the text alone, returns the bytes written
+size_t __trace_field(char* out, const char* text, uint64_t value, int width, char pad) {
+    size_t length = 0;
+
+    for (; text != NULL && text[length] != '\0'; length++) {
+        out[length] = text[length];
+    }
+
+    if (width < 0) {
+        for (int i = (int) length; i < -width; i++) {
+            out[length++] = pad;
+        }
+        return length;
+    }
+
+    if (width == 0) {
+        return length;
+    }
+
+    char digits[20];
+    int count = 0;
+
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    for (int i = count; i < width; i++) {
+        out[length++] = pad;
+    }
+
+    while (count > 0) {
+        out[length++] = digits[--count];
+    }
+
+    return length;
+}
+
+//Helper function to turn tracing on or off, the ring and the crash handlers are set up the first time
+int __trace_enable(bool enable) {
+    if (trace_ring == NULL) {
+        if (!enable) {
+            return 0;
+        }
+
+        void* map = mmap(NULL, sizeof(struct __trace_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        if (map == MAP_FAILED) {
+            perror("trace");
+            return -1;
+        }
+
+        trace_ring = map;
+
+        //Dump the trace if the shell itself dies
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = __handle_crash;
+        sa.sa_flags = SA_RESETHAND;
+        sigemptyset(&sa.sa_mask);
+
+        int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+        for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+            sigaction(signals[i], &sa, NULL);
+        }
+    }
+
+    trace_ring->enabled = enable;
+    return 0;
+}
+
+//Helper function to free all nodes of a trie
+void __trie_clear(struct __trie* t) {
+    free(t->nodes);
+    t->nodes = NULL;
+    t->count = 0;
+    t->capacity = 0;
+}
+
+//Helper function to gather up to max words below a node in sorted order, prefix holds the word leading to the node
+int __trie_collect(struct __trie* t, uint32_t node, char* prefix, size_t prefix_len, char** out, int max) {
+    int count = 0;
+
+    if (t->nodes[node].terminal && count < max) {
+        out[count] = malloc(prefix_len + 1);
+        memcpy(out[count], prefix, prefix_len);
+        out[count][prefix_len] = '\0';
+        count++;
+    }
+
+    for (uint32_t c = t->nodes[node].child; c != 0 && count < max && prefix_len + 1 < PATH_LENGTH; c = t->nodes[c].sibling) {
+        prefix[prefix_len] = t->nodes[c].byte;
+        count += __trie_collect(t, c, prefix, prefix_len + 1, out + count, max - count);
+    }
+
+    return count;
+}
+
+//Helper function to find the node reached by a prefix, TRIE_NONE if no word starts with it
+uint32_t __trie_find(struct __trie* t, const char* key, size_t length) {
+    if (t->count == 0) {
+        return TRIE_NONE;
+    }
+
+    uint32_t node = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        uint32_t c = t->nodes[node].child;
+
+        while (c != 0 && t->nodes[c].byte < (unsigned char) key[i]) {
+            c = t->nodes[c].sibling;
+        }
+
+        if (c == 0 || t->nodes[c].byte != (unsigned char) key[i]) {
+            return TRIE_NONE;
+        }
+
+        node = c;
+    }
+
+    return node;
+}
+
+//Helper function to add a word, creating the root on first use, every node on its path takes the value
+void __trie_insert(struct __trie* t, const char* key, uint32_t value) {
+    if (t->count == 0) {
+        t->capacity = 1024;
+        t->nodes = malloc(t->capacity * sizeof(struct __trie_node));
+        memset(&t->nodes[0], 0, sizeof(struct __trie_node));
+        t->count = 1;
+    }
+
+    uint32_t node = 0;
+    t->nodes[0].value = value;
+
+    for (const unsigned char* k = (const unsigned char*) key; *k != '\0'; k++) {
+        //Walk the sorted sibling list, remembering where a new node would be linked in
+        uint32_t* link = &t->nodes[node].child;
+
+        while (*link != 0 && t->nodes[*link].byte < *k) {
+            link = &t->nodes[*link].sibling;
+        }
+
+        if (*link != 0 && t->nodes[*link].byte == *k) {
+            node = *link;
+            t->nodes[node].value = value;
+            continue;
+        }
+
+        if (t->count >= t->capacity) {
+            //The link points into the array, so keep its offset across the reallocation
+            size_t offset = (char*) link - (char*) t->nodes;
+            t->capacity *= 2;
+            t->nodes = realloc(t->nodes, t->capacity * sizeof(struct __trie_node));
+            link = (uint32_t*) ((char*) t->nodes + offset);
+        }
+
+        uint32_t created = t->count++;
+        t->nodes[created].value = value;
+        t->nodes[created].byte = *k;
+        t->nodes[created].terminal = false;
+        t->nodes[created].child = 0;
+        t->nodes[created].sibling = *link;
+        *link = created;
+        node = created;
+    }
+
+    t->nodes[node].terminal = true;
+}
+
+//Helper function to append a copy of a string to a growing NULL terminated argv, one slot always stays free for NULL
+bool __argv_push(char*** argv, int* count, size_t* capacity, const char* value) {
+    if ((size_t) *count + 1 >= *capacity) {
+        char** temp = realloc(*argv, *capacity * 2 * sizeof(char*));
+
+        if (temp == NULL) {
+            return false;
+        }
+
+        *argv = temp;
+        *capacity *= 2;
+    }
+
+    (*argv)[*count] = strdup(value);
+
+    if ((*argv)[*count] == NULL) {
+        return false;
+    }
+
+    (*count)++;
+    return true;
+}
+
+//Helper function to match the remaining path components of a glob below prefix, directories come from the listing
+//cache so expanding the same directory again costs a stat
+bool __glob_expand(const char* prefix, const char* pattern, char*** argv, int* count, size_t* capacity) {
+    //Split off the first component
+    const char* slash = strchr(pattern, '/');
+    size_t component_len = (slash != NULL) ? (size_t) (slash - pattern) : strlen(pattern);
+    char component[PATH_LENGTH];
+    char path[PATH_LENGTH];
+
+    snprintf(component, sizeof(component), "%.*s", (int) component_len, pattern);
+
+    //Components without wildcards are taken literally, the whole path is checked once at the end
+    if (strpbrk(component, "*?[") == NULL) {
+        //Paths too long to ever exist match nothing
+        if (snprintf(path, sizeof(path), "%s%s%s", prefix, component, (slash != NULL) ? "/" : "") >= (int) sizeof(path)) {
+            return true;
+        }
+
+        if (slash != NULL) {
+            return __glob_expand(path, slash + 1, argv, count, capacity);
+        }
+
+        struct stat st;
+        return (lstat(path, &st) != 0) || __argv_push(argv, count, capacity, path);
+    }
+
+    struct __dir_listing* listing = __list_directory((prefix[0] != '\0') ? prefix : ".");
+    if (listing == NULL) {
+        return true;
+    }
+
+    //Copy the matches out first, expanding deeper components may evict this listing from the cache
+    int match_count = 0;
+    char** matches = malloc((listing->count + 1) * sizeof(char*));
+
+    for (int i = 0; i < listing->count; i++) {
+        struct __dir_entry* e = &listing->entries[i];
+
+        //Hidden entries only match a pattern that starts with a dot
+        if ((e->name[0] == '.' && component[0] != '.') || (slash != NULL && !e->is_dir)) {
+            continue;
+        }
+
+        if (fnmatch(component, e->name, 0) == 0 &&
+            snprintf(path, sizeof(path), "%s%s%s", prefix, e->name, (slash != NULL) ? "/" : "") < (int) sizeof(path)) {
+            matches[match_count++] = strdup(path);
+        }
+    }
+
+    bool result = true;
+
+    for (int i = 0; i < match_count; i++) {
+        if (result) {
+            result = (slash != NULL) ? __glob_expand(matches[i], slash + 1, argv, count, capacity) :
+                                       __argv_push(argv, count, capacity, matches[i]);
+        }
+
+        free(matches[i]);
+    }
+
+    free(matches);
+    return result;
+}
+
+//Helper function to append a word to argv, words with *, ? or [ are replaced by the sorted paths they match, and
+//kept as they are when nothing matches
+bool __glob_word(const char* word, char*** argv, int* count, size_t* capacity) {
+    if (strpbrk(word, "*?[") == NULL) {
+        return __argv_push(argv, count, capacity, word);
+    }
+
+    int before = *count;
+    bool result = (word[0] == '/') ? __glob_expand("/", word + 1, argv, count, capacity) :
+                                     __glob_expand("", word, argv, count, capacity);
+
+    if (result && *count == before) {
+        return __argv_push(argv, count, capacity, word);
+    }
+
+    return result;
+}
+
+//Helper function to read the next word of a command line, words are separated by blanks unless quoted with ' or ",
+//the quotes are removed and reported through quoted, returns false once the line is used up
+bool __next_word(const char** cursor, char* out, size_t cap, bool* quoted) {
+    const char* c = *cursor;
+    size_t length = 0;
+    char quote = 0;
+
+    while (*c == ' ' || *c == '\t' || *c == '\n') {
+        c++;
+    }
+
+    if (*c == '\0') {
+        *cursor = c;
+        return false;
+    }
+
+    *quoted = false;
+
+    for (; *c != '\0' && (quote != 0 || (*c != ' ' && *c != '\t' && *c != '\n')); c++) {
+        if (quote == 0 && (*c == '\'' || *c == '"')) {
+            quote = *c;
+            *quoted = true;
+        }
+
+        else if (quote != 0 && *c == quote) {
+            quote = 0;
+        }
+
+        else if (length + 1 < cap) {
+            out[length++] = *c;
+        }
+    }
+
+    out[length] = '\0';
+    *cursor = c;
+    return true;
+}
+
+//Helper function to split a command line into a NULL terminated argv, expanding globs
+char** __tokenize_input(const char* input, int* argc) {
+    //TODO get capacity from RSH datastructure
+    size_t capacity = 16;
+
+    //Allocate array for char pointers, to store passed tokens, commonly referred to as argv
+    char **argv = malloc(capacity * sizeof(char*));
+
+    //If malloc failed, return NULL, trying to abandon the !ptr notation as for others reading its harder to determine intent
+    if (argv == NULL) {
+        return NULL;
+    }
+
+    //Argc is to be used to index argv
+    int ind = 0;
+
+    char word[PATH_LENGTH];
+    bool quoted;
+
+    //Iterate through the words, growing argv as needed, quoted words are never globbed
+    while (__next_word(&input, word, sizeof(word), &quoted)) {
+        bool added = quoted ? __argv_push(&argv, &ind, &capacity, word) : __glob_word(word, &argv, &ind, &capacity);
+
+        //If the word could not be added free every pointer in argv, free argv, and return NULL to caller
+        if (!added) {
+            for (int i = 0; i < ind; free(argv[i++]));
+            free(argv);
+
+            return NULL;
+        }
+    }
+
+    //NULL terminate the array
+    argv[ind] = NULL;
+
+    //Return argc
+    *argc = ind;
+
+    //Return the pointer to args
+    return argv;
+}
+
+//Helper function to find the & that ends a command line, quoted ones are part of a word, NULL when there is none
+char* __background_marker(char* line) {
+    char* marker = NULL;
+    char quote = 0;
+
+    for (char* c = line; *c != '\0'; c++) {
+        if (quote == 0 && (*c == '\'' || *c == '"')) {
+            quote = *c;
+            marker = NULL;
+        }
+
+        else if (quote != 0) {
+            quote = (*c == quote) ? 0 : quote;
+        }
+
+        else if (*c == '&') {
+            marker = c;
+        }
+
+        else if (*c != ' ' && *c != '\t' && *c != '\n') {
+            marker = NULL;
+        }
+    }
+
+    return marker;
+}
+
+//Helper function to split a command line into the argv of each stage at every | outside quotes
+char*** __parse_pipeline(char* in, int* pipe_count) {
+    int capacity = 16;
+    char*** commands = malloc(capacity * sizeof(char**));
+    *pipe_count = 0;
+
+    char* stage = in;
+    char quote = 0;
+
+    for (char* c = in; ; c++) {
+        if (*c == '\0' || (*c == '|' && quote == 0)) {
+            bool last = (*c == '\0');
+            *c = '\0';
+
+            //Split the stage into arguments the same way as a plain command, empty stages are skipped
+            int count = 0;
+            char** args = __tokenize_input(stage, &count);
+
+            if (args != NULL && count > 0) {
+                if (*pipe_count >= capacity) {
+                    capacity *= 2;
+                    commands = realloc(commands, capacity * sizeof(char**));
+                }
+
+                //Looks complex but isnt, derefernce to get value of pipe_count, post-increment
+                commands[(*pipe_count)++] = args;
+            }
+
+            else {
+                free(args);
+            }
+
+            if (last) {
+                break;
+            }
+
+            stage = c + 1;
+        }
+
+        else if (quote == 0 && (*c == '\'' || *c == '"')) {
+            quote = *c;
+        }
+
+        else if (quote != 0 && *c == quote) {
+            quote = 0;
+        }
+    }
+
+    return commands;
+}
+
+//Helper function to open one user space hardware counter on a process and the children it forks, counting starts
+//when the process calls exec
+int __perf_open(pid_t pid, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+//Builtin that runs a command with cycle, instruction, cache miss and branch miss counters attached before it execs,
+//printing IPC and miss rates with the usual time report, or the time report alone if counters are not permitted
+int __perfstat(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: perfstat command [args...]\r\n");
+        return -1;
+    }
+
+    //The child blocks on this pipe until its counters exist
+    int gate[2];
+    if (pipe2(gate, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &r->last_start);
+    pid_t id = __fork_traced(argv[1]);
+
+    if (id == 0) {
+        setpgid(0, 0);
+        close(gate[1]);
+
+        char byte;
+        while (read(gate[0], &byte, 1) < 0 && errno == EINTR);
+        close(gate[0]);
+
+        __exec_command(argv + 1);
+    }
+
+    close(gate[0]);
+
+    if (id < 0) {
+        perror("fork");
+        close(gate[1]);
+        return -1;
+    }
+
+    setpgid(id, id);
+
+    const char* names[PERF_COUNTERS] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+    uint64_t configs[PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                       PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    int fds[PERF_COUNTERS];
+    int opened = 0;
+    int open_errno = 0;
+
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        fds[i] = __perf_open(id, configs[i]);
+
+        if (fds[i] >= 0) {
+            opened++;
+        }
+
+        else if (open_errno == 0) {
+            open_errno = errno;
+        }
+    }
+
+    //Release the child
+    close(gate[1]);
+
+    int status = __run_foreground(id, argv[1]);
+
+    if (WIFSTOPPED(status)) {
+        fprintf(stderr, "perfstat: %s stopped, counters discarded\r\n", argv[1]);
+    }
+
+    else if (opened == 0) {
+        fprintf(stderr, "perfstat: hardware counters unavailable (%s), resource usage only\r\n", strerror(open_errno));
+    }
+
+    else {
+        double values[PERF_COUNTERS];
+
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            values[i] = -1;
+            uint64_t data[3];
+
+            if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != sizeof(data)) {
+                continue;
+            }
+
+            //Scale counters the kernel had to multiplex
+            values[i] = (double) data[0];
+            if (data[2] > 0 && data[2] < data[1]) {
+                values[i] *= (double) data[1] / (double) data[2];
+            }
+        }
+
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            if (values[i] < 0) {
+                fprintf(stderr, "  %-14s %18s\r\n", names[i], "<not supported>");
+                continue;
+            }
+
+            fprintf(stderr, "  %-14s %18.0f", names[i], values[i]);
+
+            if (i == 1 && values[0] > 0) {
+                fprintf(stderr, "   %6.2f IPC", values[1] / values[0]);
+            }
+
+            else if (i > 1 && values[1] > 0) {
+                fprintf(stderr, "   %6.2f per 1K instructions", values[i] * 1000.0 / values[1]);
+            }
+
+            fprintf(stderr, "\r\n");
+        }
+    }
+
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    if (!WIFSTOPPED(status)) {
+        __command_finished(argv[1], true);
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//Helper function to run every line of ~/.rshrc as if it was typed at the prompt
+void __load_rc(void) {
+    const char* home = getenv("HOME");
+    if (home == NULL) {
+        return;
+    }
+
+    char path[PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", home, RC_FILE);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char* line = NULL;
+    size_t line_cap = 0;
+
+    while (getline(&line, &line_cap, file) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '#') {
+            continue;
+        }
+
+        int argc = 0;
+        char** argv = __tokenize_input(line, &argc);
+
+        if (argv == NULL) {
+            continue;
+        }
+
+        __handle_input(argc, argv, line);
+
+        for (int i = 0; i < argc; free(argv[i++]));
+        free(argv);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+//Comparison function to sort directory entries by name
+static int __compare_entries(const void* a, const void* b) {
+    return strcmp(((const struct __dir_entry*) a)->name, ((const struct __dir_entry*) b)->name);
+}
+
+//Helper function to free a directory listing
+void __free_listing(struct __dir_listing* listing) {
+    free(listing->entries);
+    free(listing->strings);
+    free(listing);
+}
+
+//Helper function to return the sorted contents of a directory, kept in a small LRU keyed by device and inode so
+//completion and globbing share it, a cached listing costs one stat while the directory's mtime is unchanged
+struct __dir_listing* __list_directory(const char* path) {
+    struct __rsh* r = __rsh_get();
+    struct stat st;
+
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    //Look the directory up, unlinking it so it can be moved to the front
+    struct __dir_listing** link = &r->dir_cache;
+    struct __dir_listing* cached = NULL;
+    int depth = 0;
+
+    while (*link != NULL) {
+        if ((*link)->dev == st.st_dev && (*link)->ino == st.st_ino) {
+            cached = *link;
+            *link = cached->next;
+            break;
+        }
+
+        //Evict whatever is beyond the cache size
+        if (++depth >= DIR_CACHE_SIZE) {
+            __free_listing(*link);
+            *link = NULL;
+            break;
+        }
+
+        link = &(*link)->next;
+    }
+
+    //An unchanged mtime only proves nothing changed if the listing was read a clear tick after that mtime
+    if (cached != NULL) {
+        long long since = (cached->listed.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + (cached->listed.tv_nsec - st.st_mtim.tv_nsec);
+
+        if (cached->mtime.tv_sec == st.st_mtim.tv_sec && cached->mtime.tv_nsec == st.st_mtim.tv_nsec && since > DIR_RACY_NS) {
+            cached->next = r->dir_cache;
+            r->dir_cache = cached;
+            return cached;
+        }
+
+        __free_listing(cached);
+    }
+
+    DIR* d = opendir(path);
+    if (d == NULL) {
+        return NULL;
+    }
+
+    struct __dir_listing* listing = calloc(1, sizeof(struct __dir_listing));
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    clock_gettime(CLOCK_REALTIME, &listing->listed);
+
+    //Names go into one buffer, offsets are stored until it stops moving
+    size_t capacity = 64;
+    size_t used = 0;
+    size_t strings_capacity = 4096;
+    size_t* offsets = malloc(capacity * sizeof(size_t));
+    unsigned char* types = malloc(capacity);
+    listing->strings = malloc(strings_capacity);
+
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t name_len = strlen(de->d_name) + 1;
+
+        if ((size_t) listing->count >= capacity) {
+            capacity *= 2;
+            offsets = realloc(offsets, capacity * sizeof(size_t));
+            types = realloc(types, capacity);
+        }
+
+        if (used + name_len > strings_capacity) {
+            strings_capacity = (strings_capacity * 2 > used + name_len) ? strings_capacity * 2 : used + name_len;
+            listing->strings = realloc(listing->strings, strings_capacity);
+        }
+
+        memcpy(listing->strings + used, de->d_name, name_len);
+        offsets[listing->count] = used;
+        types[listing->count] = de->d_type;
+        listing->count++;
+        used += name_len;
+    }
+
+    //Only entries whose type readdir could not tell, or symlinks that may point at directories, need a stat
+    listing->entries = malloc((listing->count + 1) * sizeof(struct __dir_entry));
+
+    for (int i = 0; i < listing->count; i++) {
+        struct __dir_entry* e = &listing->entries[i];
+        e->name = listing->strings + offsets[i];
+        e->is_dir = (types[i] == DT_DIR);
+
+        if (types[i] == DT_UNKNOWN || types[i] == DT_LNK) {
+            struct stat entry;
+            e->is_dir = (fstatat(dirfd(d), e->name, &entry, 0) == 0 && S_ISDIR(entry.st_mode));
+        }
+    }
+
+    closedir(d);
+    free(offsets);
+    free(types);
+
+    qsort(listing->entries, listing->count, sizeof(struct __dir_entry), __compare_entries);
+
+    listing->next = r->dir_cache;
+    r->dir_cache = listing;
+    return listing;
+}
+
+//Helper function to binary search a listing for the first entry not sorting below the given name
+int __listing_find(struct __dir_listing* listing, const char* name) {
+    int low = 0;
+    int high = listing->count;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if (strcmp(listing->entries[mid].name, name) < 0) {
+            low = mid + 1;
+        }
+
+        else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+//Helper function to collect every child that changed state without blocking, foreground children are handed to
+//the waiter in __wait_foreground and everything else updates the job table
+void __reap_jobs(void) {
+    struct __rsh* r = __rsh_get();
+    int status;
+    pid_t pid;
+    struct rusage usage;
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        bool foreground = false;
+        __trace(TRACE_REAP, pid, status, NULL);
+
+        for (int i = 0; i < r->fg_count; i++) {
+            if (r->fg_procs[i].pid == pid && !WIFCONTINUED(status)) {
+                r->fg_procs[i].status = status;
+                r->fg_procs[i].changed = true;
+                r->fg_procs[i].usage = usage;
+                clock_gettime(CLOCK_MONOTONIC, &r->fg_procs[i].end);
+                foreground = true;
+            }
+        }
+
+        if (!foreground) {
+            __update_job(pid, status);
+        }
+    }
+
+    __admit_queued_jobs();
+}
+
+//Helper function to print the resource usage of the last foreground command, if forced by the time keyword or
+//if it ran for longer than the reporttime setting
+void __report_usage(const char* command, bool forced) {
+    struct __rsh* r = __rsh_get();
+    double wall = (r->last_end.tv_sec - r->last_start.tv_sec) + (r->last_end.tv_nsec - r->last_start.tv_nsec) / 1e9;
+
+    if (!forced && (r->report_time < 0 || wall < r->report_time)) {
+        return;
+    }
+
+    r->time_next = false;
+
+    struct rusage* u = &r->last_usage;
+    fprintf(stderr, "%s: real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  faults %ld major/%ld minor  ctxsw %ld vol/%ld invol\r\n",
+        command, wall,
+        u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6,
+        u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6,
+        u->ru_maxrss, u->ru_majflt, u->ru_minflt, u->ru_nvcsw, u->ru_nivcsw);
+}
+
+//
+void __remove_job(pid_t pid) {
+    struct __rsh* r = __rsh_get();
+    struct __job_node** curr = &r->job_buffer;
+    while (*curr) {
+        if ((*curr)->pid == pid) {
+            struct __job_node* temp = *curr;
+            *curr = (*curr)->next;
+            free(temp->command);
+            free(temp->group);
+            free(temp);
+            return;
+        }
+        curr = &(*curr)->next;
+    }
+}
+
+//Helper function to give a forked child the terminal and wait for it to exit or stop, returns the wait status
+int __run_foreground(pid_t id, const char* command) {
+    struct __rsh* r = __rsh_get();
+
+    //Set child as foreground process group
+    signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN_FILENO, id);
+    signal(SIGTTOU, SIG_DFL);
+
+    //Ignore signals while child is running
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+
+    //Store running process ID
+    r->running_process = id;
+    int status;
+
+    //Wait for child process
+    __wait_foreground(&id, &status, 1);
+
+    //Restore signal handlers
+    signal(SIGINT, __handle_ctrlc);
+    signal(SIGTSTP, __handle_ctrlz);
+
+    //Reset terminal foreground to shell safely
+    signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN_FILENO, getpid());
+
+    //Handle job status, a stopped job keeps the terminal modes it had for fg
+    if (WIFSTOPPED(status)) {
+        struct __job_node* job = __append_job(id, command, JOB_STOPPED); //Add to jobs as stopped
+        job->has_modes = (tcgetattr(STDIN_FILENO, &job->modes) == 0);
+    } else {
+        __remove_job(id); //Remove from jobs if exited
+    }
+
+    //Whatever modes the job left behind, the shell carries on with the original ones
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
+    signal(SIGTTOU, SIG_DFL);
+
+    r->running_process = 0;
+    return status;
+}
+
+//Helper function to run one command line to completion outside of the interactive loop, returns its exit status
+int __run_command_line(char* line) {
+    int pipe_count = 0;
+    char*** commands = __parse_pipeline(line, &pipe_count);
+    int res = 0;
+
+    if (pipe_count > 1) {
+        res = __handle_pipeline(commands, pipe_count);
+    }
+
+    else if (pipe_count == 1 && commands[0][0] != NULL) {
+        pid_t pid = __fork_traced(commands[0][0]);
+
+        if (pid == 0) {
+            __exec_command(commands[0]);
+        }
+
+        else if (pid < 0) {
+            perror("fork");
+            res = -1;
+        }
+
+        else {
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+            __trace(TRACE_REAP, pid, status, NULL);
+            res = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+
+    //Cleanup commands array
+    for (int i = 0; i < pipe_count; i++) {
+        for (int j = 0; commands[i][j] != NULL; j++) {
+            free(commands[i][j]);
+        }
+
+        free(commands[i]);
+    }
+
+    free(commands);
+    return res;
+}
+
+//
+struct __rsh* __rsh_get() {
+    if (!rsh_initialized) {
+        __enable_raw_mode();
+
+        //Set up handling of ctrl signals
+        signal(SIGINT, __handle_ctrlc);
+        signal(SIGTSTP, __handle_ctrlz);
+
+        rsh = (struct __rsh*) malloc(sizeof(struct __rsh));
+        rsh->sigint_pipe[1] = -1;
+
+        //Initialize "class members"
+        rsh->capacity = 16;
+        rsh->running_process = 0;
+        rsh->hist_buffer = malloc(1 * sizeof(struct __hist_node));
+        rsh->job_buffer = NULL;
+        rsh->group_buffer = NULL;
+        rsh->watcher_count = 0;
+        rsh->fg_procs = NULL;
+        rsh->fg_count = 0;
+        rsh->time_next = false;
+        rsh->report_time = -1;
+        rsh->current_command = NULL;
+        rsh->last_status = 0;
+        rsh->last_stages = 0;
+        rsh->metrics = NULL;
+        rsh->capture_jobs = false;
+        rsh->recorder = NULL;
+        rsh->job_logs = NULL;
+        rsh->control_fd = -1;
+        rsh->control_path = NULL;
+        memset(&rsh->exec_index, 0, sizeof(struct __trie));
+        memset(&rsh->command_tree, 0, sizeof(struct __bk_tree));
+        rsh->path_dirs = NULL;
+        rsh->path_dir_count = 0;
+        rsh->exec_index_checked = false;
+        rsh->dir_cache = NULL;
+        rsh->prompt_template = NULL;
+        rsh->prompt_ops = NULL;
+        rsh->prompt_op_count = 0;
+        memset(&rsh->prompt_buffer, 0, sizeof(struct __string_builder));
+        memset(&rsh->prompt_shown, 0, sizeof(struct __string_builder));
+        rsh->prompt_worker = NULL;
+        rsh->at_prompt = false;
+
+        const char* home = getenv("HOME");
+        rsh->z_file = NULL;
+        memset(&rsh->z_db, 0, sizeof(struct __z_db));
+        rsh->z_pending = calloc(Z_BATCH, sizeof(struct __z_visit));
+        rsh->z_pending_count = 0;
+        rsh->z_pending_capacity = Z_BATCH;
+        rsh->z_flushing = false;
+        rsh->z_flush_done = false;
+
+        if (home != NULL) {
+            rsh->z_file = malloc(PATH_LENGTH);
+            snprintf(rsh->z_file, PATH_LENGTH, "%s/%s", home, Z_FILE);
+        }
+        memset(&rsh->hist_index, 0, sizeof(struct __trie));
+        rsh->hist_entries = NULL;
+        rsh->hist_count = 0;
+        rsh->hist_capacity = 0;
+
+        //Highlighting and suggestions need a terminal that understands escape sequences
+        const char* term = getenv("TERM");
+        rsh->ansi = isatty(STDOUT_FILENO) && term != NULL && strcmp(term, "dumb") != 0;
+        rsh->view.length = 0;
+        rsh->view.cursor = 0;
+        rsh->view.hint = 0;
+        rsh->view.place = 0;
+        rsh->view.pending = false;
+        memset(&rsh->decoder, 0, sizeof(struct __key_decoder));
+        memset(rsh->stats_table, 0, sizeof(rsh->stats_table));
+        rsh->path = strdup(getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin");;
+
+        rsh->hist_buffer->command = NULL;
+        rsh->hist_buffer->next = NULL;
+
+        rsh_initialized = true;
+        __compile_prompt(PROMPT_DEFAULT);
+
+        //Route SIGCHLD through the event loop, restarting interrupted blocking calls elsewhere
+        event_loop_pid = getpid();
+        pipe2(rsh->sigchld_pipe, O_CLOEXEC | O_NONBLOCK);
+        __watch_fd(rsh->sigchld_pipe[0], POLLIN, __on_sigchld, NULL);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = __handle_sigchld;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGCHLD, &sa, NULL);
+
+        //Terminal resizes come through the event loop too
+        struct winsize ws;
+        rsh->term_width = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+        pipe2(rsh->winch_pipe, O_CLOEXEC | O_NONBLOCK);
+        __watch_fd(rsh->winch_pipe[0], POLLIN, __on_sigwinch, NULL);
+
+        sa.sa_handler = __handle_sigwinch;
+        sigaction(SIGWINCH, &sa, NULL);
+
+        //And CTRL+C as a signal, until the pipe exists the handler's write fails harmlessly
+        pipe2(rsh->sigint_pipe, O_CLOEXEC | O_NONBLOCK);
+        __watch_fd(rsh->sigint_pipe[0], POLLIN, __on_sigint, NULL);
+
+        //Return the pointer to the newly allocated memory
+        return rsh;
+    }
+    
+    return rsh;
+}
+
+//Helper function to destroy the rsh datastructure and any contained elements
+void __rsh_destroy(struct __rsh* r) {
+    //Clean history
+    struct __hist_node* hist = r->hist_buffer;
+    while (hist) {
+        struct __hist_node* next = hist->next;
+        free(hist->command);
+        free(hist);
+        hist = next;
+    }
+    
+    //Clean captured job output
+    struct __job_log* log = r->job_logs;
+    while (log) {
+        struct __job_log* next = log->next;
+        __job_log_close(log);
+        free(log->command);
+        free(log);
+        log = next;
+    }
+
+    //Clean jobs
+    struct __job_node* job = r->job_buffer;
+    while (job) {
+        struct __job_node* next = job->next;
+        free(job->command);
+        free(job->group);
+        free(job);
+        job = next;
+    }
+
+    //Clean latency histograms
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        struct __latency_node* node = r->stats_table[i];
+        while (node) {
+            struct __latency_node* next = node->next;
+            free(node->command);
+            free(node);
+            node = next;
+        }
+    }
+
+    //Clean job groups
+    struct __job_group* group = r->group_buffer;
+    while (group) {
+        struct __job_group* next = group->next;
+        free(group->name);
+        free(group);
+        group = next;
+    }
+
+    close(r->sigchld_pipe[0]);
+    close(r->sigchld_pipe[1]);
+    close(r->winch_pipe[0]);
+    close(r->winch_pipe[1]);
+    close(r->sigint_pipe[0]);
+    close(r->sigint_pipe[1]);
+
+    __control_stop();
+
+    //Clean completion and suggestion state
+    __trie_clear(&r->exec_index);
+    __bk_clear(&r->command_tree);
+    __trie_clear(&r->hist_index);
+    free(r->hist_entries);
+
+    for (int i = 0; i < r->path_dir_count; i++) {
+        free(r->path_dirs[i].path);
+    }
+
+    free(r->path_dirs);
+
+    while (r->dir_cache != NULL) {
+        struct __dir_listing* next = r->dir_cache->next;
+        __free_listing(r->dir_cache);
+        r->dir_cache = next;
+    }
+
+    //Stop the prompt worker
+    __prompt_worker_stop();
+    __compile_prompt(NULL);
+    free(r->prompt_buffer.data);
+    free(r->prompt_shown.data);
+
+    //Write out the remaining directory visits
+    __z_flush(true);
+
+    if (r->z_db.map != NULL) {
+        munmap(r->z_db.map, r->z_db.size);
+    }
+
+    free(r->z_pending);
+    free(r->z_file);
+
+    //Flush pending metrics
+    if (r->metrics != NULL) {
+        __writer_close(r->metrics);
+    }
+
+    //Finish a recording still running
+    __record_stop();
+
+    free(r->path);
+    free(r);
+}
+//Builtin that admits background commands into a named group only while fewer than -j of its jobs run, otherwise
+//it blocks until a slot frees up, or with -q queues the command to be started by the reaper, the command is taken
+//from the line as typed so its quoting holds when it is parsed again at launch
+int __sem(int argc, char** argv, const char* line) {
+    const char* name = "default";
+    int limit = 0;
+    bool queue = false;
+    bool wait_all = false;
+    int arg = 1;
+
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "--id") == 0 && arg + 1 < argc) {
+            name = argv[++arg];
+        }
+
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            limit = atoi(argv[++arg]);
+        }
+
+        else if (strcmp(argv[arg], "-q") == 0) {
+            queue = true;
+        }
+
+        else if (strcmp(argv[arg], "--wait") == 0) {
+            wait_all = true;
+        }
+
+        //Ends the options, for commands starting with a dash
+        else if (strcmp(argv[arg], "--") == 0) {
+            arg++;
+            break;
+        }
+
+        else {
+            arg = argc;
+            wait_all = false;
+            break;
+        }
+
+        arg++;
+    }
+
+    if (!wait_all && arg >= argc) {
+        fprintf(stderr, "Usage: sem [--id name] [-j jobs] [-q] [--] command [args...] | sem [--id name] --wait\r\n");
+        return -1;
+    }
+
+    struct __job_group* group = __get_job_group(name, limit);
+    __reap_jobs();
+
+    //The command is what follows the options on the line, quotes and all
+    char word[PATH_LENGTH];
+    bool quoted;
+    for (int i = 0; i < arg && __next_word(&line, word, sizeof(word), &quoted); i++);
+
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+
+    char* command = strdup(line);
+
+    if (queue && !wait_all) {
+        struct __job_node* job = __append_job(0, command, JOB_QUEUED);
+        job->group = strdup(group->name);
+        __admit_queued_jobs();
+        printf("[%d] %s\r\n", job->id, job->status == JOB_QUEUED ? "queued" : "started");
+        free(command);
+        return 0;
+    }
+
+    //Block on any child until the group drops below its limit, or drains completely for --wait
+    while (true) {
+        bool queued = false;
+        for (struct __job_node* j = __rsh_get()->job_buffer; j != NULL; j = j->next) {
+            if (j->status == JOB_QUEUED && j->group != NULL && strcmp(j->group, group->name) == 0) {
+                queued = true;
+            }
+        }
+
+        int running = __group_running(group->name);
+        if (wait_all ? (running == 0 && !queued) : (running < group->limit)) {
+            break;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, WUNTRACED);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        __update_job(pid, status);
+        __reap_jobs();
+    }
+
+    if (!wait_all) {
+        struct __job_node* job = __launch_background(command, group->name);
+        if (job != NULL) {
+            printf("[%d] %d\r\n", job->id, job->pid);
+        }
+    }
+
+    free(command);
+    return 0;
+}
+
+//Helper function to append raw bytes to a string builder, keeping it terminated
+void __sb_append(struct __string_builder* sb, const char* data, size_t length) {
+    if (sb->length + length + 1 > sb->capacity) {
+        size_t capacity = (sb->capacity > 0) ? sb->capacity : 256;
+        while (sb->length + length + 1 > capacity) {
+            capacity *= 2;
+        }
+
+        char* temp = realloc(sb->data, capacity);
+        if (temp == NULL) {
+            return;
+        }
+
+        sb->data = temp;
+        sb->capacity = capacity;
+    }
+
+    memcpy(sb->data + sb->length, data, length);
+    sb->length += length;
+    sb->data[sb->length] = '\0';
+}
+
+//Helper function to append formatted text to a string builder
+void __sb_printf(struct __string_builder* sb, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (needed < 0) {
+        return;
+    }
+
+    if (sb->length + needed + 1 > sb->capacity) {
+        size_t capacity = (sb->capacity > 0) ? sb->capacity : 256;
+        while (sb->length + needed + 1 > capacity) {
+            capacity *= 2;
+        }
+
+        char* temp = realloc(sb->data, capacity);
+        if (temp == NULL) {
+            return;
+        }
+
+        sb->data = temp;
+        sb->capacity = capacity;
+    }
+
+    va_start(args, format);
+    vsnprintf(sb->data + sb->length, needed + 1, format, args);
+    va_end(args);
+    sb->length += needed;
+}
+
+//Builtin that changes shell settings, "set" alone lists them
+int __set(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+
+    if (argc == 1) {
+        printf("reporttime %g\r\n", r->report_time);
+        printf("metrics %s\r\n", r->metrics != NULL ? "on" : "off");
+        printf("capture %s\r\n", r->capture_jobs ? "on" : "off");
+        printf("control %s\r\n", r->control_path != NULL ? r->control_path : "off");
+        printf("prompt '%s'\r\n", r->prompt_template);
+        printf("trace %s\r\n", (trace_ring != NULL && trace_ring->enabled) ? "on" : "off");
+
+        if (r->metrics != NULL && r->metrics->dropped > 0) {
+            printf("metrics dropped %lu bytes\r\n", (unsigned long) r->metrics->dropped);
+        }
+
+        return 0;
+    }
+
+    //Execution tracing, like -x in other shells but recorded into the trace ring instead of printed
+    if (strcmp(argv[1], "-x") == 0 || strcmp(argv[1], "+x") == 0) {
+        return __trace_enable(argv[1][0] == '-');
+    }
+
+    if (strcmp(argv[1], "reporttime") == 0 && argc > 2) {
+        r->report_time = atof(argv[2]);
+        return 0;
+    }
+
+    //Metrics sink, "off" disables it, anything else is the file to append to
+    if (strcmp(argv[1], "metrics") == 0 && argc > 2) {
+        if (r->metrics != NULL) {
+            __writer_close(r->metrics);
+            r->metrics = NULL;
+        }
+
+        if (strcmp(argv[2], "off") != 0) {
+            r->metrics = __writer_open(argv[2]);
+            return (r->metrics != NULL) ? 0 : -1;
+        }
+
+        return 0;
+    }
+
+    //Prompt template, segments are described at __compile_prompt
+    if (strcmp(argv[1], "prompt") == 0 && argc > 2) {
+        __compile_prompt(argv[2]);
+        return 0;
+    }
+
+    //Background job output capture, read back with joblog
+    if (strcmp(argv[1], "capture") == 0 && argc > 2) {
+        r->capture_jobs = (strcmp(argv[2], "on") == 0);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "control") == 0 && argc > 2) {
+        if (strcmp(argv[2], "on") == 0) {
+            __control_start();
+            return (r->control_fd >= 0) ? 0 : -1;
+        }
+
+        __control_stop();
+        return 0;
+    }
+
+    fprintf(stderr, "Usage: set [-x | +x | reporttime <seconds, negative disables> | metrics <file|off> | capture <on|off> | control <on|off> | prompt <template>]\r\n");
+    return -1;
+}
+
+//Helper function to compile a prompt template into literal and segment operations once, so drawing the prompt never
+//parses it again, segments are %d working directory with ~ for home, %b git branch with * when tracked files
+//changed, %e exit status of the last command when non-zero, %j number of jobs when non-zero, %t run time of the
+//last command and %% a percent sign, NULL only frees the current program
+void __compile_prompt(const char* template) {
+    struct __rsh* r = __rsh_get();
+
+    for (int i = 0; i < r->prompt_op_count; i++) {
+        free(r->prompt_ops[i].text);
+    }
+
+    free(r->prompt_ops);
+    free(r->prompt_template);
+    r->prompt_ops = NULL;
+    r->prompt_op_count = 0;
+    r->prompt_template = NULL;
+    r->prompt_git = false;
+
+    if (template == NULL) {
+        return;
+    }
+
+    r->prompt_template = strdup(template);
+    r->prompt_ops = malloc((strlen(template) + 1) * sizeof(struct __prompt_op));
+
+    const char* literal = template;
+
+    for (const char* c = template; ; c++) {
+        int type = -1;
+
+        if (*c == '%' && c[1] != '\0') {
+            switch (c[1]) {
+                case 'd': type = PROMPT_CWD; break;
+                case 'b': type = PROMPT_BRANCH; break;
+                case 'e': type = PROMPT_STATUS; break;
+                case 'j': type = PROMPT_JOBS; break;
+                case 't': type = PROMPT_DURATION; break;
+                default: type = PROMPT_LITERAL; break;
+            }
+        }
+
+        //Close the literal run before a segment, an escaped character starts the next run
+        if (type >= 0 || *c == '\0') {
+            if (c > literal) {
+                struct __prompt_op* op = &r->prompt_ops[r->prompt_op_count++];
+                op->type = PROMPT_LITERAL;
+                op->text = strndup(literal, c - literal);
+                op->length = c - literal;
+            }
+
+            if (*c == '\0') {
+                break;
+            }
+
+            if (type != PROMPT_LITERAL) {
+                struct __prompt_op* op = &r->prompt_ops[r->prompt_op_count++];
+                op->type = type;
+                op->text = NULL;
+                op->length = 0;
+                r->prompt_git |= (type == PROMPT_BRANCH);
+            }
+
+            c++;
+            literal = (type == PROMPT_LITERAL) ? c : c + 1;
+        }
+    }
+}
+
+//Helper function to print the prompt at the start of the line with a single write
+void __draw_prompt(void) {
+    struct __rsh* r = __rsh_get();
+    __render_prompt();
+
+    r->prompt_shown.length = 0;
+    __sb_append(&r->prompt_shown, r->prompt_buffer.data, r->prompt_buffer.length);
+
+    //Columns the prompt takes, escape sequences take none and a new line starts counting again
+    const char* text = r->prompt_buffer.data;
+    size_t length = r->prompt_buffer.length;
+    r->prompt_width = 0;
+
+    for (size_t i = 0; i < length;) {
+        if (text[i] == '\x1b' && i + 1 < length && text[i + 1] == '[') {
+            for (i += 2; i < length && !(text[i] >= 0x40 && text[i] <= 0x7e); i++);
+            i++;
+        }
+
+        else if (text[i] == '\r' || text[i] == '\n') {
+            r->prompt_width = 0;
+            i++;
+        }
+
+        else if ((unsigned char) text[i] < 0x20) {
+            i++;
+        }
+
+        else {
+            int w;
+            i = __next_grapheme(text, length, i, &w);
+            r->prompt_width += w;
+        }
+    }
+
+    fflush(stdout);
+    write(STDOUT_FILENO, r->prompt_buffer.data, r->prompt_buffer.length);
+}
+
+//Helper function to read a big endian 32 bit value from the git index
+static uint32_t __read_be32(const unsigned char* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+//Helper function to check the stat data recorded in the git index against the work tree, which is what makes
+//"git status" slow in big repositories, any file whose size or mtime differs or that is missing makes it dirty
+static bool __git_index_dirty(const char* gitdir, const char* root) {
+    char path[PATH_LENGTH];
+    if (snprintf(path, sizeof(path), "%s/index", gitdir) >= (int) sizeof(path)) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 12) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    size_t size = st.st_size;
+    const unsigned char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    uint32_t version = __read_be32(map + 4);
+    uint32_t count = __read_be32(map + 8);
+    bool dirty = false;
+    size_t offset = 12;
+    char name[PATH_LENGTH] = "";
+    size_t name_len = 0;
+
+    if (memcmp(map, "DIRC", 4) != 0 || version < 2 || version > 4) {
+        count = 0;
+    }
+
+    //Entries: ctime, mtime, dev, ino, mode, uid, gid, size, object id and flags, then the path
+    for (uint32_t i = 0; i < count && !dirty && offset + 62 <= size; i++) {
+        const unsigned char* e = map + offset;
+        uint32_t mtime_sec = __read_be32(e + 8);
+        uint32_t mtime_nsec = __read_be32(e + 12);
+        uint32_t mode = __read_be32(e + 24);
+        uint32_t file_size = __read_be32(e + 36);
+        uint16_t flags = (e[60] << 8) | e[61];
+        size_t at = offset + 62 + ((version >= 3 && (flags & 0x4000)) ? 2 : 0);
+
+        if (version == 4) {
+            //The path drops a number of bytes from the end of the previous one and appends a suffix
+            size_t strip = 0;
+            unsigned char byte;
+
+            do {
+                if (at >= size) {
+                    goto done;
+                }
+                byte = map[at++];
+                strip = (strip << 7) | (byte & 127);
+                strip += (byte & 128) ? 1 : 0;
+            } while (byte & 128);
+
+            const unsigned char* end = memchr(map + at, '\0', size - at);
+            if (end == NULL || strip > name_len || name_len - strip + (end - (map + at)) >= sizeof(name)) {
+                goto done;
+            }
+
+            name_len -= strip;
+            memcpy(name + name_len, map + at, end - (map + at));
+            name_len += end - (map + at);
+            name[name_len] = '\0';
+            offset = (end - map) + 1;
+        }
+
+        else {
+            const unsigned char* end = memchr(map + at, '\0', size - at);
+            if (end == NULL || (size_t) (end - (map + at)) >= sizeof(name)) {
+                goto done;
+            }
+
+            name_len = end - (map + at);
+            memcpy(name, map + at, name_len + 1);
+
+            //Entries are padded with NULs to a multiple of eight bytes
+            offset += ((at - offset) + name_len + 8) & ~(size_t) 7;
+        }
+
+        //Submodules are not checked
+        if ((mode & 0170000) == 0160000) {
+            continue;
+        }
+
+        //A path too long to check is left out rather than checked truncated
+        char file[PATH_LENGTH * 2];
+        if (snprintf(file, sizeof(file), "%s/%s", root, name) >= (int) sizeof(file)) {
+            continue;
+        }
+
+        dirty = (lstat(file, &st) != 0 || (uint32_t) st.st_size != file_size || (uint32_t) st.st_mtim.tv_sec != mtime_sec ||
+                 (mtime_nsec != 0 && (uint32_t) st.st_mtim.tv_nsec != mtime_nsec));
+    }
+
+done:
+    munmap((void*) map, size);
+    return dirty;
+}
+
+//Helper function to find the repository containing a directory and read its branch and whether tracked files changed,
+//returns false outside a repository
+bool __git_state(const char* cwd, char* branch, size_t cap, bool* dirty) {
+    //Every path is kept to PATH_LENGTH, one that does not fit is treated as no repository rather than truncated
+    char root[PATH_LENGTH];
+    char gitdir[PATH_LENGTH];
+
+    if (snprintf(root, sizeof(root), "%s", cwd) >= (int) sizeof(root)) {
+        return false;
+    }
+
+    //Walk up to the first directory with a .git, which is a directory or a file naming one
+    while (true) {
+        struct stat st;
+
+        if (snprintf(gitdir, sizeof(gitdir), "%s/.git", root) >= (int) sizeof(gitdir)) {
+            return false;
+        }
+
+        if (stat(gitdir, &st) == 0) {
+            if (S_ISREG(st.st_mode)) {
+                char link[PATH_LENGTH] = "";
+                FILE* f = fopen(gitdir, "r");
+
+                if (f == NULL || fgets(link, sizeof(link), f) == NULL || strncmp(link, "gitdir: ", 8) != 0) {
+                    if (f != NULL) {
+                        fclose(f);
+                    }
+                    return false;
+                }
+
+                fclose(f);
+                link[strcspn(link, "\r\n")] = '\0';
+
+                int length = (link[8] == '/') ? snprintf(gitdir, sizeof(gitdir), "%s", link + 8) :
+                                                snprintf(gitdir, sizeof(gitdir), "%s/%s", root, link + 8);
+
+                if (length >= (int) sizeof(gitdir)) {
+                    return false;
+                }
+            }
+
+            break;
+        }
+
+        char* slash = strrchr(root, '/');
+        if (slash == NULL || slash == root) {
+            return false;
+        }
+
+        *slash = '\0';
+    }
+
+    //HEAD names the branch, or holds the commit when detached
+    char head[PATH_LENGTH];
+    if (snprintf(head, sizeof(head), "%s/HEAD", gitdir) >= (int) sizeof(head)) {
+        return false;
+    }
+
+    FILE* f = fopen(head, "r");
+    if (f == NULL || fgets(head, sizeof(head), f) == NULL) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        return false;
+    }
+
+    fclose(f);
+    head[strcspn(head, "\r\n")] = '\0';
+
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        snprintf(branch, cap, "%s", head + 16);
+    }
+
+    else if (strncmp(head, "ref: ", 5) == 0) {
+        snprintf(branch, cap, "%s", head + 5);
+    }
+
+    else {
+        snprintf(branch, cap, "%.7s", head);
+    }
+
+    *dirty = __git_index_dirty(gitdir, root);
+    return true;
+}
+
+//Callback for results from the prompt worker, the prompt is redrawn in place with the input after it if it changed
+void __on_prompt_data(int fd, short revents, void* data) {
+    struct __rsh* r = __rsh_get();
+    char drain[64];
+
+    while (read(fd, drain, sizeof(drain)) > 0);
+
+    if (!r->at_prompt || !r->ansi) {
+        return;
+    }
+
+    __render_prompt();
+
+    if (r->prompt_buffer.length != r->prompt_shown.length ||
+        memcmp(r->prompt_buffer.data, r->prompt_shown.data, r->prompt_buffer.length) != 0) {
+        __redraw_line();
+    }
+}
+
+//Helper function to ask the worker for the git state of the current directory, starting it the first time a
+//template shows the branch
+void __prompt_request(void) {
+    struct __rsh* r = __rsh_get();
+    char cwd[PATH_LENGTH];
+
+    if (!r->prompt_git || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return;
+    }
+
+    //Without a free watcher the answers could not be picked up, the prompt goes without git state
+    if (r->prompt_worker == NULL && r->watcher_count >= MAX_WATCHERS) {
+        return;
+    }
+
+    if (r->prompt_worker == NULL) {
+        struct __prompt_worker* w = calloc(1, sizeof(struct __prompt_worker));
+
+        if (pipe2(w->notify, O_CLOEXEC | O_NONBLOCK) != 0) {
+            free(w);
+            return;
+        }
+
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+
+        //Keep the thread from taking signals meant for the shell
+        sigset_t all;
+        sigset_t previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &previous);
+        int res = pthread_create(&w->thread, NULL, __prompt_thread, w);
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+        if (res != 0) {
+            close(w->notify[0]);
+            close(w->notify[1]);
+            free(w);
+            return;
+        }
+
+        r->prompt_worker = w;
+        __watch_fd(w->notify[0], POLLIN, __on_prompt_data, NULL);
+    }
+
+    struct __prompt_worker* w = r->prompt_worker;
+    pthread_mutex_lock(&w->lock);
+    free(w->request);
+    w->request = strdup(cwd);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+//Thread that computes the git state for the latest requested directory, a request made while it works replaces any
+//older one that was not started yet
+void* __prompt_thread(void* arg) {
+    struct __prompt_worker* w = arg;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (true) {
+        while (w->request == NULL && !w->stop) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+
+        if (w->stop) {
+            break;
+        }
+
+        char* cwd = w->request;
+        w->request = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        char branch[PROMPT_SEGMENT] = "";
+        bool dirty = false;
+
+        if (!__git_state(cwd, branch, sizeof(branch), &dirty)) {
+            branch[0] = '\0';
+        }
+
+        pthread_mutex_lock(&w->lock);
+        snprintf(w->cwd, sizeof(w->cwd), "%s", cwd);
+        memcpy(w->branch, branch, sizeof(branch));
+        w->dirty = dirty;
+        free(cwd);
+
+        ssize_t ignored = write(w->notify[1], "", 1);
+        (void) ignored;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+//Helper function to stop the prompt worker
+void __prompt_worker_stop(void) {
+    struct __rsh* r = __rsh_get();
+    struct __prompt_worker* w = r->prompt_worker;
+
+    if (w == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    __unwatch_fd(w->notify[0]);
+    close(w->notify[0]);
+    close(w->notify[1]);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    free(w->request);
+    free(w);
+    r->prompt_worker = NULL;
+}
+
+//Helper function to run the compiled prompt into the reused prompt buffer, starting with a carriage return so it is
+//drawn from the first column, segments with nothing to show are empty
+void __render_prompt(void) {
+    struct __rsh* r = __rsh_get();
+    struct __string_builder* out = &r->prompt_buffer;
+
+    out->length = 0;
+    __sb_append(out, "\r", 1);
+
+    for (int i = 0; i < r->prompt_op_count; i++) {
+        struct __prompt_op* op = &r->prompt_ops[i];
+
+        switch (op->type) {
+            case PROMPT_LITERAL:
+                __sb_append(out, op->text, op->length);
+                break;
+
+            case PROMPT_CWD: {
+                char cwd[PATH_LENGTH];
+                const char* home = getenv("HOME");
+
+                if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                    break;
+                }
+
+                size_t home_len = (home != NULL) ? strlen(home) : 0;
+
+                if (home_len > 1 && strncmp(cwd, home, home_len) == 0 && (cwd[home_len] == '/' || cwd[home_len] == '\0')) {
+                    __sb_printf(out, "~%s", cwd + home_len);
+                }
+
+                else {
+                    __sb_append(out, cwd, strlen(cwd));
+                }
+
+                break;
+            }
+
+            //Last known state, only if it belongs to this directory
+            case PROMPT_BRANCH: {
+                char cwd[PATH_LENGTH];
+                struct __prompt_worker* w = r->prompt_worker;
+
+                if (w == NULL || getcwd(cwd, sizeof(cwd)) == NULL) {
+                    break;
+                }
+
+                pthread_mutex_lock(&w->lock);
+                if (strcmp(w->cwd, cwd) == 0 && w->branch[0] != '\0') {
+                    __sb_printf(out, "%s%s", w->branch, w->dirty ? "*" : "");
+                }
+                pthread_mutex_unlock(&w->lock);
+                break;
+            }
+
+            case PROMPT_STATUS:
+                if (r->last_status != 0) {
+                    __sb_printf(out, "%d", r->last_status);
+                }
+                break;
+
+            case PROMPT_JOBS: {
+                int jobs = 0;
+
+                for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+                    jobs += (j->status != JOB_DONE);
+                }
+
+                if (jobs > 0) {
+                    __sb_printf(out, "%d", jobs);
+                }
+                break;
+            }
+
+            case PROMPT_DURATION: {
+                int64_t ms = (r->last_end.tv_sec - r->last_start.tv_sec) * 1000LL + (r->last_end.tv_nsec - r->last_start.tv_nsec) / 1000000;
+
+                if (ms < 0) {
+                    break;
+                }
+
+                if (ms < 1000) {
+                    __sb_printf(out, "%ldms", (long) ms);
+                }
+
+                else if (ms < 60000) {
+                    __sb_printf(out, "%.1fs", ms / 1000.0);
+                }
+
+                else {
+                    __sb_printf(out, "%ldm%lds", (long) (ms / 60000), (long) (ms / 1000 % 60));
+                }
+                break;
+            }
+        }
+    }
+}
+
+//Builtin that changes the working directory, to $HOME without an argument or to $OLDPWD with "-", and records the
+//visit for z
+int __cd(int argc, char** argv) {
+    const char* target = (argc > 1) ? argv[1] : getenv("HOME");
+
+    if (argc > 1 && strcmp(argv[1], "-") == 0) {
+        target = getenv("OLDPWD");
+
+        if (target == NULL) {
+            fprintf(stderr, "cd: OLDPWD not set\r\n");
+            return -1;
+        }
+
+        printf("%s\r\n", target);
+    }
+
+    if (target == NULL) {
+        fprintf(stderr, "cd: HOME not set\r\n");
+        return -1;
+    }
+
+    char previous[PATH_LENGTH];
+    bool have_previous = (getcwd(previous, sizeof(previous)) != NULL);
+
+    if (chdir(target) != 0) {
+        fprintf(stderr, "cd: %s: %s\r\n", target, strerror(errno));
+        return -1;
+    }
+
+    char current[PATH_LENGTH];
+    if (have_previous) {
+        setenv("OLDPWD", previous, 1);
+    }
+
+    if (getcwd(current, sizeof(current)) != NULL) {
+        setenv("PWD", current, 1);
+        __z_visit(current);
+    }
+
+    return 0;
+}
+
+//Helper function to weigh a rank by how recently the directory was visited, recent visits count for more
+static double __z_score(double rank, int64_t time, int64_t now) {
+    int64_t age = now - time;
+
+    if (age < 3600) {
+        return rank * 4;
+    }
+
+    if (age < 86400) {
+        return rank * 2;
+    }
+
+    if (age < 604800) {
+        return rank / 2;
+    }
+
+    return rank / 4;
+}
+
+//Helper function to check that every fragment occurs in the path in order
+static bool __z_matches(const char* path, int count, char** fragments) {
+    for (int i = 0; i < count; i++) {
+        const char* found = strstr(path, fragments[i]);
+
+        if (found == NULL) {
+            return false;
+        }
+
+        path = found + strlen(fragments[i]);
+    }
+
+    return true;
+}
+
+//Comparison function to sort jump candidates by ascending score
+static int __z_compare(const void* a, const void* b) {
+    double left = ((const struct __z_visit*) a)->count;
+    double right = ((const struct __z_visit*) b)->count;
+    return (left > right) - (left < right);
+}
+
+//Builtin that jumps to the highest ranked visited directory whose path contains the fragments in order, ranks
+//combine visit count and recency, "z -l" lists the matches with their scores instead
+int __z(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+    bool list = (argc > 1 && strcmp(argv[1], "-l") == 0);
+    int fragment_count = argc - 1 - list;
+    char** fragments = argv + 1 + list;
+
+    if (fragment_count == 0 && !list) {
+        fprintf(stderr, "Usage: z [-l] fragment [fragment...]\r\n");
+        return -1;
+    }
+
+    __z_map();
+
+    //Candidates reuse the visit struct, count holds the score
+    struct __z_db* db = &r->z_db;
+    struct __z_visit* candidates = malloc((db->count + r->z_pending_count + 1) * sizeof(struct __z_visit));
+    int candidate_count = 0;
+    int64_t now = time(NULL);
+
+    for (uint32_t i = 0; i < db->count; i++) {
+        const struct __z_record* record = &db->records[i];
+        char path[PATH_LENGTH];
+        snprintf(path, sizeof(path), "%.*s", (int) record->length, db->strings + record->offset);
+
+        double rank = record->rank;
+        int64_t last = record->time;
+
+        //Visits not written out yet add to the stored entry
+        for (int k = 0; k < r->z_pending_count; k++) {
+            if (strcmp(r->z_pending[k].path, path) == 0) {
+                rank += r->z_pending[k].count;
+                last = r->z_pending[k].time;
+            }
+        }
+
+        if (__z_matches(path, fragment_count, fragments)) {
+            candidates[candidate_count].path = strdup(path);
+            candidates[candidate_count].count = __z_score(rank, last, now);
+            candidate_count++;
+        }
+    }
+
+    //Pending visits of directories the database does not know yet
+    for (int k = 0; k < r->z_pending_count; k++) {
+        struct __z_visit* visit = &r->z_pending[k];
+        bool known = false;
+
+        for (int i = 0; i < candidate_count && !known; i++) {
+            known = (strcmp(candidates[i].path, visit->path) == 0);
+        }
+
+        if (!known && __z_matches(visit->path, fragment_count, fragments)) {
+            bool stored = false;
+
+            for (uint32_t i = 0; i < db->count && !stored; i++) {
+                stored = (db->records[i].length == strlen(visit->path) &&
+                          memcmp(db->strings + db->records[i].offset, visit->path, db->records[i].length) == 0);
+            }
+
+            if (!stored) {
+                candidates[candidate_count].path = strdup(visit->path);
+                candidates[candidate_count].count = __z_score(visit->count, visit->time, now);
+                candidate_count++;
+            }
+        }
+    }
+
+    qsort(candidates, candidate_count, sizeof(struct __z_visit), __z_compare);
+    int res = 0;
+
+    if (list) {
+        for (int i = 0; i < candidate_count; i++) {
+            printf("%10.1f  %s\r\n", candidates[i].count, candidates[i].path);
+        }
+    }
+
+    else {
+        //Take the best match that still exists
+        int best = candidate_count - 1;
+        struct stat st;
+
+        while (best >= 0 && (stat(candidates[best].path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+            best--;
+        }
+
+        if (best < 0) {
+            fprintf(stderr, "z: no match\r\n");
+            res = -1;
+        }
+
+        else {
+            char* cd_argv[] = {"cd", candidates[best].path, NULL};
+            res = __cd(2, cd_argv);
+        }
+    }
+
+    for (int i = 0; i < candidate_count; free(candidates[i++].path));
+    free(candidates);
+    return res;
+}
+
+//Helper function to hand the buffered visits to a thread that merges them into the database, only one rewrite runs
+//at a time, without wait a rewrite still running is left alone and the visits are kept for a later flush so cd never
+//waits on the disk, wait joins both the previous rewrite and the new one
+void __z_flush(bool wait) {
+    struct __rsh* r = __rsh_get();
+
+    if (r->z_flushing) {
+        if (!wait && !__atomic_load_n(&r->z_flush_done, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+
+        pthread_join(r->z_thread, NULL);
+        r->z_flushing = false;
+    }
+
+    if (r->z_pending_count == 0 || r->z_file == NULL) {
+        return;
+    }
+
+    struct __z_batch* batch = malloc(sizeof(struct __z_batch));
+    batch->file = strdup(r->z_file);
+    batch->visits = r->z_pending;
+    batch->count = r->z_pending_count;
+    batch->done = &r->z_flush_done;
+
+    r->z_pending = calloc(Z_BATCH, sizeof(struct __z_visit));
+    r->z_pending_count = 0;
+    r->z_pending_capacity = Z_BATCH;
+    r->z_flush_done = false;
+
+    //Keep the thread from taking signals meant for the shell
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int res = pthread_create(&r->z_thread, NULL, __z_flush_thread, batch);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (res != 0) {
+        __z_flush_thread(batch);
+        return;
+    }
+
+    r->z_flushing = true;
+
+    if (wait) {
+        pthread_join(r->z_thread, NULL);
+        r->z_flushing = false;
+    }
+}
+
+//Comparison function to sort visits by path
+static int __z_compare_paths(const void* a, const void* b) {
+    return strcmp(((const struct __z_visit*) a)->path, ((const struct __z_visit*) b)->path);
+}
+
+//Thread that merges a batch of visits into the database, the new file is written beside the old one and renamed over
+//it so the shell's mapping of the old file stays valid until it notices the change
+void* __z_flush_thread(void* arg) {
+    struct __z_batch* batch = arg;
+
+    //Read the current entries, a missing or corrupt database starts empty
+    struct __z_visit* entries = NULL;
+    int count = 0;
+    int fd = open(batch->file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct __z_header)) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            const struct __z_header* header = map;
+            const struct __z_record* records = (const struct __z_record*) (header + 1);
+            size_t strings_at = sizeof(struct __z_header) + (size_t) header->count * sizeof(struct __z_record);
+
+            if (header->magic == Z_MAGIC && strings_at <= (size_t) st.st_size) {
+                entries = malloc((header->count + batch->count) * sizeof(struct __z_visit));
+
+                for (uint32_t i = 0; i < header->count; i++) {
+                    if (strings_at + records[i].offset + records[i].length <= (size_t) st.st_size) {
+                        entries[count].path = strndup((const char*) map + strings_at + records[i].offset, records[i].length);
+                        entries[count].count = records[i].rank;
+                        entries[count].time = records[i].time;
+                        count++;
+                    }
+                }
+            }
+
+            munmap(map, st.st_size);
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (entries == NULL) {
+        entries = malloc(batch->count * sizeof(struct __z_visit));
+    }
+
+    //Entries are sorted already, each visit either bumps one found by binary search or is appended
+    int stored = count;
+    double total = 0;
+
+    for (int i = 0; i < batch->count; i++) {
+        struct __z_visit* visit = &batch->visits[i];
+        struct __z_visit key = {visit->path, 0, 0};
+        struct __z_visit* found = bsearch(&key, entries, stored, sizeof(struct __z_visit), __z_compare_paths);
+
+        if (found != NULL) {
+            found->count += visit->count;
+            found->time = visit->time;
+            free(visit->path);
+        }
+
+        else {
+            entries[count++] = *visit;
+        }
+    }
+
+    qsort(entries, count, sizeof(struct __z_visit), __z_compare_paths);
+
+    for (int i = 0; i < count; i++) {
+        total += entries[i].count;
+    }
+
+    //Age everything once the ranks add up past the limit, entries falling below one visit are forgotten
+    bool aging = (total > Z_MAX_RANK);
+
+    //Lay the file out in memory, then write it in one go
+    size_t strings_length = 0;
+    int kept = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (aging) {
+            entries[i].count *= 0.9;
+        }
+
+        if (entries[i].count >= 1.0) {
+            strings_length += strlen(entries[i].path);
+            kept++;
+        }
+    }
+
+    size_t size = sizeof(struct __z_header) + kept * sizeof(struct __z_record) + strings_length;
+    char* image = malloc(size);
+    struct __z_header* header = (struct __z_header*) image;
+    struct __z_record* records = (struct __z_record*) (header + 1);
+    char* strings = (char*) (records + kept);
+    uint32_t offset = 0;
+    int index = 0;
+
+    header->magic = Z_MAGIC;
+    header->count = kept;
+
+    for (int i = 0; i < count; i++) {
+        if (entries[i].count >= 1.0) {
+            size_t length = strlen(entries[i].path);
+            records[index].offset = offset;
+            records[index].length = length;
+            records[index].rank = entries[i].count;
+            records[index].time = entries[i].time;
+            memcpy(strings + offset, entries[i].path, length);
+            offset += length;
+            index++;
+        }
+
+        free(entries[i].path);
+    }
+
+    char temp[PATH_LENGTH + 32];
+    snprintf(temp, sizeof(temp), "%s.%d", batch->file, getpid());
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd >= 0) {
+        bool written = (write(fd, image, size) == (ssize_t) size);
+        close(fd);
+
+        if (!written || rename(temp, batch->file) != 0) {
+            unlink(temp);
+        }
+    }
+
+    free(image);
+    free(entries);
+    free(batch->visits);
+    free(batch->file);
+    __atomic_store_n(batch->done, true, __ATOMIC_RELEASE);
+    free(batch);
+    return NULL;
+}
+
+//Helper function to make sure the mapping shows the current database file, one stat when nothing changed
+void __z_map(void) {
+    struct __rsh* r = __rsh_get();
+    struct __z_db* db = &r->z_db;
+    struct stat st;
+
+    if (r->z_file == NULL || stat(r->z_file, &st) != 0) {
+        return;
+    }
+
+    if (db->map != NULL && db->ino == st.st_ino && db->mtime.tv_sec == st.st_mtim.tv_sec &&
+        db->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return;
+    }
+
+    if (db->map != NULL) {
+        munmap(db->map, db->size);
+    }
+
+    memset(db, 0, sizeof(struct __z_db));
+
+    int fd = open(r->z_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    void* map = ((size_t) st.st_size >= sizeof(struct __z_header)) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    //Only use the file if every record lies inside it
+    const struct __z_header* header = map;
+    size_t strings_at = sizeof(struct __z_header) + (size_t) header->count * sizeof(struct __z_record);
+    bool valid = (header->magic == Z_MAGIC && strings_at <= (size_t) st.st_size);
+    const struct __z_record* records = (const struct __z_record*) (header + 1);
+
+    for (uint32_t i = 0; valid && i < header->count; i++) {
+        valid = (strings_at + records[i].offset + records[i].length <= (size_t) st.st_size);
+    }
+
+    if (!valid) {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    db->map = map;
+    db->size = st.st_size;
+    db->ino = st.st_ino;
+    db->mtime = st.st_mtim;
+    db->count = header->count;
+    db->records = records;
+    db->strings = (const char*) map + strings_at;
+}
+
+//Helper function to buffer a directory visit, cd only touches memory, the database is rewritten every Z_BATCH
+//distinct directories by a background thread
+void __z_visit(const char* path) {
+    struct __rsh* r = __rsh_get();
+    int64_t now = time(NULL);
+
+    for (int i = 0; i < r->z_pending_count; i++) {
+        if (strcmp(r->z_pending[i].path, path) == 0) {
+            r->z_pending[i].count += 1;
+            r->z_pending[i].time = now;
+            return;
+        }
+    }
+
+    if (r->z_pending_count >= r->z_pending_capacity) {
+        r->z_pending_capacity *= 2;
+        r->z_pending = realloc(r->z_pending, r->z_pending_capacity * sizeof(struct __z_visit));
+    }
+
+    r->z_pending[r->z_pending_count].path = strdup(path);
+    r->z_pending[r->z_pending_count].count = 1;
+    r->z_pending[r->z_pending_count].time = now;
+    r->z_pending_count++;
+
+    if (r->z_pending_count >= Z_BATCH) {
+        __z_flush(false);
+    }
+}
+
+//Comparison function to sort histograms by command name
+static int __stats_compare(const void* a, const void* b) {
+    return strcmp((*(struct __latency_node**) a)->command, (*(struct __latency_node**) b)->command);
+}
+
+//Builtin that prints runtime percentiles of every command run so far, or of the named ones, "stats -r" resets them
+int __stats(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        for (int i = 0; i < STATS_SLOTS; i++) {
+            struct __latency_node* node = r->stats_table[i];
+            while (node) {
+                struct __latency_node* next = node->next;
+                free(node->command);
+                free(node);
+                node = next;
+            }
+            r->stats_table[i] = NULL;
+        }
+
+        return 0;
+    }
+
+    int count = 0;
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        for (struct __latency_node* node = r->stats_table[i]; node != NULL; node = node->next) {
+            count++;
+        }
+    }
+
+    struct __latency_node** sorted = malloc((count + 1) * sizeof(struct __latency_node*));
+    int n = 0;
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        for (struct __latency_node* node = r->stats_table[i]; node != NULL; node = node->next) {
+            sorted[n++] = node;
+        }
+    }
+
+    qsort(sorted, n, sizeof(struct __latency_node*), __stats_compare);
+
+    printf("%-20s %8s %12s %12s %12s %12s\r\n", "command", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+    for (int i = 0; i < n; i++) {
+        struct __latency_node* node = sorted[i];
+
+        //Filter by the requested command names
+        bool listed = (argc == 1);
+        for (int a = 1; a < argc; a++) {
+            listed |= (strcmp(argv[a], node->command) == 0);
+        }
+
+        if (!listed) {
+            continue;
+        }
+
+        printf("%-20s %8lu %12.3f %12.3f %12.3f %12.3f\r\n", node->command, (unsigned long) node->count,
+            __stats_percentile(node, 0.50) / 1000.0, __stats_percentile(node, 0.90) / 1000.0,
+            __stats_percentile(node, 0.99) / 1000.0, node->max / 1000.0);
+    }
+
+    free(sorted);
+    return 0;
+}
+
+//Helper function mapping a duration to its histogram bucket, values below 16us get exact buckets, above that each
+//power of two is divided into STATS_SUB_COUNT equal sub-buckets
+int __stats_bucket(uint64_t value) {
+    if (value < STATS_SUB_COUNT) {
+        return (int) value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int) ((value >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1));
+    int bucket = (exponent - STATS_SUB_BITS + 1) * STATS_SUB_COUNT + sub;
+
+    return (bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1;
+}
+
+//Helper function giving the midpoint of the range of values a bucket holds
+uint64_t __stats_bucket_value(int bucket) {
+    if (bucket < STATS_SUB_COUNT) {
+        return (uint64_t) bucket;
+    }
+
+    int exponent = bucket / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (bucket % STATS_SUB_COUNT);
+    uint64_t width = 1ULL << (exponent - STATS_SUB_BITS);
+
+    return (1ULL << exponent) + sub * width + width / 2;
+}
+
+//Helper function to find the value below which the given fraction of recorded runs fall
+uint64_t __stats_percentile(struct __latency_node* node, double fraction) {
+    uint64_t target = (uint64_t) (fraction * node->count + 0.999999);
+    uint64_t seen = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += node->buckets[i];
+
+        if (seen >= target) {
+            uint64_t value = __stats_bucket_value(i);
+            return (value < node->max) ? value : node->max;
+        }
+    }
+
+    return node->max;
+}
+
+//Helper function to add one run of a command to its histogram, keyed by the program name without its directory
+void __stats_record(const char* command, uint64_t micros) {
+    struct __rsh* r = __rsh_get();
+    const char* slash = strrchr(command, '/');
+    const char* name = (slash != NULL) ? slash + 1 : command;
+
+    //djb2 hash of the name
+    uint32_t hash = 5381;
+    for (const char* c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+
+    struct __latency_node** slot = &r->stats_table[hash % STATS_SLOTS];
+    struct __latency_node* node = *slot;
+
+    while (node != NULL && strcmp(node->command, name) != 0) {
+        node = node->next;
+    }
+
+    if (node == NULL) {
+        node = calloc(1, sizeof(struct __latency_node));
+        if (node == NULL) {
+            return;
+        }
+
+        node->command = strdup(name);
+        node->next = *slot;
+        *slot = node;
+    }
+
+    node->count++;
+    node->buckets[__stats_bucket(micros)]++;
+
+    if (micros > node->max) {
+        node->max = micros;
+    }
+}
+
+//Builtin that runs the targets of a task file, each task starts once its dependencies succeeded and up to -j tasks
+//run at the same time, ready tasks on the longest remaining chain are started first
+int __tasks(int argc, char** argv) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_going = false;
+    int arg = 1;
+
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            jobs = atoi(argv[++arg]);
+        }
+
+        else if (strcmp(argv[arg], "-k") == 0) {
+            keep_going = true;
+        }
+
+        //Anything else would be taken for the task file
+        else {
+            arg = argc;
+            break;
+        }
+
+        arg++;
+    }
+
+    if (arg >= argc) {
+        fprintf(stderr, "Usage: tasks [-j jobs] [-k] <file> [target...]\r\n");
+        return 1;
+    }
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    int count = 0;
+    struct __task* tasks = __tasks_parse(argv[arg++], &count);
+
+    if (tasks == NULL) {
+        return 1;
+    }
+
+    //Resolve dependency names, then invert them so completions can release dependents directly
+    for (int i = 0; i < count; i++) {
+        for (int d = 0; d < tasks[i].dep_count; d++) {
+            int dep = __tasks_find(tasks, count, tasks[i].dep_names[d]);
+
+            if (dep < 0) {
+                fprintf(stderr, "tasks: %s depends on unknown target %s\r\n", tasks[i].name, tasks[i].dep_names[d]);
+                __tasks_destroy(tasks, count);
+                return 1;
+            }
+
+            tasks[i].deps[d] = dep;
+            int* dependents = realloc(tasks[dep].dependents, (tasks[dep].dependent_count + 1) * sizeof(int));
+
+            if (dependents == NULL) {
+                fprintf(stderr, "tasks: out of memory\r\n");
+                __tasks_destroy(tasks, count);
+                return 1;
+            }
+
+            tasks[dep].dependents = dependents;
+            tasks[dep].dependents[tasks[dep].dependent_count++] = i;
+        }
+    }
+
+    //Select requested targets and everything they need, or the whole file
+    if (arg < argc) {
+        for (; arg < argc; arg++) {
+            int target = __tasks_find(tasks, count, argv[arg]);
+
+            if (target < 0) {
+                fprintf(stderr, "tasks: unknown target %s\r\n", argv[arg]);
+                __tasks_destroy(tasks, count);
+                return 1;
+            }
+
+            __tasks_mark_wanted(tasks, target);
+        }
+    }
+
+    else {
+        for (int i = 0; i < count; i++) {
+            tasks[i].wanted = true;
+        }
+    }
+
+    int wanted = 0;
+    for (int i = 0; i < count; i++) {
+        if (tasks[i].wanted) {
+            tasks[i].remaining = tasks[i].dep_count;
+            wanted++;
+        }
+    }
+
+    //Topological order with Kahn's algorithm, leftover tasks are part of a cycle
+    int* order = malloc((count + 1) * sizeof(int));
+    int* indegree = malloc((count + 1) * sizeof(int));
+    int head = 0;
+    int tail = 0;
+
+    for (int i = 0; i < count; i++) {
+        indegree[i] = tasks[i].remaining;
+        if (tasks[i].wanted && indegree[i] == 0) {
+            order[tail++] = i;
+        }
+    }
+
+    while (head < tail) {
+        struct __task* t = &tasks[order[head++]];
+
+        for (int d = 0; d < t->dependent_count; d++) {
+            int next = t->dependents[d];
+            if (tasks[next].wanted && --indegree[next] == 0) {
+                order[tail++] = next;
+            }
+        }
+    }
+
+    free(indegree);
+
+    if (tail < wanted) {
+        fprintf(stderr, "tasks: dependency cycle detected\r\n");
+        free(order);
+        __tasks_destroy(tasks, count);
+        return 1;
+    }
+
+    //Critical path length, walking the order backwards so dependents are always finished first
+    for (int i = tail - 1; i >= 0; i--) {
+        struct __task* t = &tasks[order[i]];
+        int longest = 0;
+
+        for (int d = 0; d < t->dependent_count; d++) {
+            struct __task* next = &tasks[t->dependents[d]];
+            if (next->wanted && next->priority > longest) {
+                longest = next->priority;
+            }
+        }
+
+        t->priority = longest + (t->command_count > 0 ? t->command_count : 1);
+    }
+
+    free(order);
+
+    int running = 0;
+    int result = 0;
+    bool stop = false;
+
+    while (true) {
+        //Fill free slots with the ready task that has the most work behind it
+        while (!stop && running < jobs) {
+            int best = -1;
+
+            for (int i = 0; i < count; i++) {
+                if (tasks[i].wanted && tasks[i].state == TASK_PENDING && tasks[i].remaining == 0) {
+                    if (best < 0 || tasks[i].priority > tasks[best].priority) {
+                        best = i;
+                    }
+                }
+            }
+
+            if (best < 0) {
+                break;
+            }
+
+            struct __task* t = &tasks[best];
+            printf("[tasks] start %s\r\n", t->name);
+            fflush(stdout);
+
+            clock_gettime(CLOCK_MONOTONIC, &t->start);
+            pid_t pid = __fork_traced(t->name);
+
+            //The task process runs its commands in order and stops at the first failure
+            if (pid == 0) {
+                for (int c = 0; c < t->command_count; c++) {
+                    int res = __run_command_line(t->commands[c]);
+                    if (res != 0) {
+                        _exit(res > 0 && res < 256 ? res : 1);
+                    }
+                }
+
+                _exit(0);
+            }
+
+            else if (pid < 0) {
+                perror("fork");
+                t->state = TASK_FAILED;
+                result = 1;
+                stop = !keep_going;
+                continue;
+            }
+
+            t->pid = pid;
+            t->state = TASK_RUNNING;
+            running++;
+        }
+
+        if (running == 0) {
+            break;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        __trace(TRACE_REAP, pid, status, NULL);
+
+        for (int i = 0; i < count; i++) {
+            struct __task* t = &tasks[i];
+
+            if (t->state != TASK_RUNNING || t->pid != pid) {
+                continue;
+            }
+
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - t->start.tv_sec) + (end.tv_nsec - t->start.tv_nsec) / 1e9;
+            running--;
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                t->state = TASK_DONE;
+                printf("[tasks] done %s (%.2fs)\r\n", t->name, elapsed);
+
+                for (int d = 0; d < t->dependent_count; d++) {
+                    tasks[t->dependents[d]].remaining--;
+                }
+            }
+
+            //Dependents of a failed task never become ready
+            else {
+                t->state = TASK_FAILED;
+                result = 1;
+                stop = !keep_going;
+                printf("[tasks] failed %s (%.2fs)\r\n", t->name, elapsed);
+            }
+
+            fflush(stdout);
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (tasks[i].wanted && tasks[i].state == TASK_PENDING) {
+            printf("[tasks] skipped %s\r\n", tasks[i].name);
+        }
+    }
+
+    __tasks_destroy(tasks, count);
+    return result;
+}
+
+//Helper function to free a parsed task file
+void __tasks_destroy(struct __task* tasks, int count) {
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < tasks[i].command_count; c++) {
+            free(tasks[i].commands[c]);
+        }
+
+        for (int d = 0; d < tasks[i].dep_count; d++) {
+            free(tasks[i].dep_names[d]);
+        }
+
+        free(tasks[i].name);
+        free(tasks[i].commands);
+        free(tasks[i].dep_names);
+        free(tasks[i].deps);
+        free(tasks[i].dependents);
+    }
+
+    free(tasks);
+}
+
+//Helper function to look up a task by name, -1 if it does not exist
+int __tasks_find(struct __task* tasks, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(tasks[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+//Helper function to select a task along with everything it depends on
+void __tasks_mark_wanted(struct __task* tasks, int index) {
+    if (tasks[index].wanted) {
+        return;
+    }
+
+    tasks[index].wanted = true;
+
+    for (int d = 0; d < tasks[index].dep_count; d++) {
+        __tasks_mark_wanted(tasks, tasks[index].deps[d]);
+    }
+}
+
+//Helper function to read a task file, targets are "name: deps..." lines followed by indented command lines
+struct __task* __tasks_parse(const char* path, int* count) {
+    FILE* file = fopen(path, "r");
+
+    if (file == NULL) {
+        perror("tasks");
+        return NULL;
+    }
+
+    int capacity = 16;
+    struct __task* tasks = calloc(capacity, sizeof(struct __task));
+    struct __task* current = NULL;
+    char* line = NULL;
+    size_t line_cap = 0;
+    int line_no = 0;
+    *count = 0;
+
+    if (tasks == NULL) {
+        goto out_of_memory;
+    }
+
+    while (getline(&line, &line_cap, file) >= 0) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        //Skip leading whitespace to classify the line
+        char* text = line;
+        while (*text == ' ' || *text == '\t') {
+            text++;
+        }
+
+        if (*text == '\0' || *text == '#') {
+            continue;
+        }
+
+        //Indented lines are commands of the most recent target
+        if (text != line) {
+            if (current == NULL) {
+                fprintf(stderr, "tasks: %s:%d: command outside of a target\r\n", path, line_no);
+                goto fail;
+            }
+
+            char** commands = realloc(current->commands, (current->command_count + 1) * sizeof(char*));
+            if (commands == NULL) {
+                goto out_of_memory;
+            }
+
+            current->commands = commands;
+            current->commands[current->command_count++] = strdup(text);
+            continue;
+        }
+
+        char* colon = strchr(line, ':');
+        if (colon == NULL) {
+            fprintf(stderr, "tasks: %s:%d: expected \"target: dependencies\"\r\n", path, line_no);
+            goto fail;
+        }
+
+        *colon = '\0';
+        char* name = strtok(line, " \t");
+
+        if (name == NULL || __tasks_find(tasks, *count, name) >= 0) {
+            fprintf(stderr, "tasks: %s:%d: missing or duplicate target name\r\n", path, line_no);
+            goto fail;
+        }
+
+        if (*count >= capacity) {
+            struct __task* grown = realloc(tasks, capacity * 2 * sizeof(struct __task));
+            if (grown == NULL) {
+                goto out_of_memory;
+            }
+
+            capacity *= 2;
+            tasks = grown;
+            memset(&tasks[*count], 0, (capacity - *count) * sizeof(struct __task));
+        }
+
+        current = &tasks[(*count)++];
+        current->name = strdup(name);
+
+        for (char* dep = strtok(colon + 1, " \t"); dep != NULL; dep = strtok(NULL, " \t")) {
+            char** dep_names = realloc(current->dep_names, (current->dep_count + 1) * sizeof(char*));
+            if (dep_names == NULL) {
+                goto out_of_memory;
+            }
+
+            current->dep_names = dep_names;
+            current->dep_names[current->dep_count++] = strdup(dep);
+        }
+
+        current->deps = calloc(current->dep_count + 1, sizeof(int));
+        if (current->deps == NULL) {
+            goto out_of_memory;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return tasks;
+
+out_of_memory:
+    fprintf(stderr, "tasks: %s: out of memory\r\n", path);
+
+fail:
+    free(line);
+    fclose(file);
+    __tasks_destroy(tasks, *count);
+    return NULL;
+}
+
+//Helper function to apply a status change reported by waitpid to the job table
+void __update_job(pid_t pid, int status) {
+    struct __rsh* r = __rsh_get();
+    struct __job_node* job = r->job_buffer;
+
+    while (job != NULL && job->pid != pid) {
+        job = job->next;
+    }
+
+    if (job == NULL) {
+        return;
+    }
+
+    if (WIFSTOPPED(status)) {
+        job->status = JOB_STOPPED;
+    }
+
+    else if (WIFCONTINUED(status)) {
+        job->status = JOB_RUNNING;
+    }
+
+    //Kept until it is reported at the prompt or collected by wait
+    else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        job->status = JOB_DONE;
+        job->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+}
+
+//Helper function to stop servicing a file descriptor from the event loop
+void __unwatch_fd(int fd) {
+    struct __rsh* r = __rsh_get();
+
+    for (int i = 0; i < r->watcher_count; i++) {
+        if (r->watchers[i].fd == fd) {
+            r->watchers[i] = r->watchers[--r->watcher_count];
+            return;
+        }
+    }
+}
+
+//Builtin that blocks on the event loop until background jobs finish, "wait" waits for all of them, "wait %job" or
+//"wait pid" for one, and "wait -n" for whichever finishes first, the exit status of the job is returned
+int __wait(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+    bool any = (argc > 1 && strcmp(argv[1], "-n") == 0);
+    struct __job_node* target = NULL;
+    int result = 0;
+
+    if (argc > 1 && !any) {
+        target = __find_job(argv[1]);
+
+        if (target == NULL) {
+            fprintf(stderr, "wait: no such job %s\r\n", argv[1]);
+            return 127;
+        }
+    }
+
+    //CTRL+C interrupts the wait rather than the whole shell
+    wait_interrupted = 0;
+    signal(SIGINT, __handle_wait_interrupt);
+
+    while (!wait_interrupted) {
+        __reap_jobs();
+
+        bool pending = false;
+        struct __job_node* done = NULL;
+
+        for (struct __job_node* j = r->job_buffer; j != NULL; j = j->next) {
+            if (target != NULL && j != target) {
+                continue;
+            }
+
+            if (j->status == JOB_DONE) {
+                done = j;
+            }
+
+            else if (j->status == JOB_RUNNING || j->status == JOB_QUEUED) {
+                pending = true;
+            }
+        }
+
+        //A stopped job would never finish while waited for
+        if (target != NULL && target->status == JOB_STOPPED) {
+            fprintf(stderr, "wait: job %d is stopped\r\n", target->id);
+            result = 128 + SIGTSTP;
+            break;
+        }
+
+        //A job collected by wait is not reported again at the prompt
+        if ((any || target != NULL) && done != NULL) {
+            result = done->exit_status;
+            __remove_job(done->pid);
+            break;
+        }
+
+        if (!pending) {
+            if (any) {
+                result = 127;
+            }
+
+            //Plain wait collects everything that finished silently
+            else if (target == NULL) {
+                struct __job_node* j = r->job_buffer;
+                while (j != NULL) {
+                    struct __job_node* next = j->next;
+                    if (j->status == JOB_DONE) {
+                        __remove_job(j->pid);
+                    }
+                    j = next;
+                }
+            }
+
+            break;
+        }
+
+        __event_wait(-1, -1);
+    }
+
+    signal(SIGINT, __handle_ctrlc);
+
+    if (wait_interrupted) {
+        printf("\r\n");
+        return 130;
+    }
+
+    return result;
+}
+
+//Helper function to block until each foreground child exited, or one of them stopped, reaping through the event
+//loop in the shell so background jobs are serviced meanwhile, forked helpers fall back to a blocking waitpid
+void __wait_foreground(pid_t* pids, int* statuses, int count) {
+    struct __rsh* r = __rsh_get();
+    struct __fg_proc procs[count];
+
+    for (int i = 0; i < count; i++) {
+        procs[i].pid = pids[i];
+        procs[i].status = 0;
+        procs[i].changed = false;
+        memset(&procs[i].usage, 0, sizeof(struct rusage));
+    }
+
+    r->fg_procs = procs;
+    r->fg_count = count;
+
+    while (true) {
+        int finished = 0;
+        bool stopped = false;
+
+        for (int i = 0; i < count; i++) {
+            if (procs[i].changed) {
+                finished++;
+                stopped |= WIFSTOPPED(procs[i].status);
+            }
+        }
+
+        if (finished == count || stopped) {
+            break;
+        }
+
+        if (getpid() == event_loop_pid) {
+            __event_wait(-1, -1);
+            continue;
+        }
+
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        __trace(TRACE_REAP, pid, status, NULL);
+
+        for (int i = 0; i < count; i++) {
+            if (procs[i].pid == pid) {
+                procs[i].status = status;
+                procs[i].changed = true;
+                procs[i].usage = usage;
+                clock_gettime(CLOCK_MONOTONIC, &procs[i].end);
+            }
+        }
+    }
+
+    //Summarize the command for time reports, peak memory is the largest stage rather than a sum
+    memset(&r->last_usage, 0, sizeof(struct rusage));
+    r->last_end = r->last_start;
+
+    int last = procs[count - 1].status;
+    r->last_status = WIFEXITED(last) ? WEXITSTATUS(last) : WIFSIGNALED(last) ? 128 + WTERMSIG(last) : 0;
+    r->last_stages = count;
+
+    for (int i = 0; i < count; i++) {
+        statuses[i] = procs[i].status;
+
+        struct rusage* u = &procs[i].usage;
+        timeradd(&r->last_usage.ru_utime, &u->ru_utime, &r->last_usage.ru_utime);
+        timeradd(&r->last_usage.ru_stime, &u->ru_stime, &r->last_usage.ru_stime);
+        r->last_usage.ru_maxrss = (u->ru_maxrss > r->last_usage.ru_maxrss) ? u->ru_maxrss : r->last_usage.ru_maxrss;
+        r->last_usage.ru_minflt += u->ru_minflt;
+        r->last_usage.ru_majflt += u->ru_majflt;
+        r->last_usage.ru_nvcsw += u->ru_nvcsw;
+        r->last_usage.ru_nivcsw += u->ru_nivcsw;
+
+        if (procs[i].changed && (procs[i].end.tv_sec > r->last_end.tv_sec ||
+            (procs[i].end.tv_sec == r->last_end.tv_sec && procs[i].end.tv_nsec > r->last_end.tv_nsec))) {
+            r->last_end = procs[i].end;
+        }
+    }
+
+    r->fg_procs = NULL;
+    r->fg_count = 0;
+}
+
+//Helper function to service a file descriptor from the event loop, returns false when the watcher table is full
+bool __watch_fd(int fd, short events, void (*callback)(int, short, void*), void* data) {
+    struct __rsh* r = __rsh_get();
+
+    if (r->watcher_count >= MAX_WATCHERS) {
+        return false;
+    }
+
+    r->watchers[r->watcher_count].fd = fd;
+    r->watchers[r->watcher_count].events = events;
+    r->watchers[r->watcher_count].callback = callback;
+    r->watchers[r->watcher_count].data = data;
+    r->watcher_count++;
+    return true;
+}
+
+//Builtin that packs as many items from stdin (or -a file) into each invocation of the target command as
+//the kernel's argument limit allows, optionally keeping up to -P invocations running at once
+int __xargs(int argc, char** argv) {
+    int parallel = 1;
+    int max_args = 0;
+    bool null_delim = false;
+    int in_fd = STDIN_FILENO;
+    int arg = 1;
+
+    //Parse options, the first non-option is the target command
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-0") == 0) {
+            null_delim = true;
+        }
+
+        else if (strcmp(argv[arg], "-P") == 0 && arg + 1 < argc) {
+            parallel = atoi(argv[++arg]);
+        }
+
+        else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+            max_args = atoi(argv[++arg]);
+        }
+
+        else if (strcmp(argv[arg], "-a") == 0 && arg + 1 < argc) {
+            in_fd = open(argv[++arg], O_RDONLY);
+            if (in_fd < 0) {
+                perror("xargs");
+                return 1;
+            }
+        }
+
+        else {
+            fprintf(stderr, "Usage: xargs [-0] [-P jobs] [-n max-args] [-a file] [command [args...]]\r\n");
+            return 1;
+        }
+
+        arg++;
+    }
+
+    //Reading items from the raw mode terminal would never see an EOF
+    if (in_fd == STDIN_FILENO && isatty(STDIN_FILENO)) {
+        fprintf(stderr, "xargs: items must come from a pipe or -a file\r\n");
+        return 1;
+    }
+
+    if (parallel < 1) {
+        parallel = 1;
+    }
+
+    //Command defaults to echo, like POSIX xargs
+    char* default_cmd[] = {"echo", NULL};
+    char** fixed = (arg < argc) ? &argv[arg] : default_cmd;
+    int fixed_count = (arg < argc) ? argc - arg : 1;
+
+    size_t budget = __xargs_budget(fixed, fixed_count);
+
+    //Items of the pending batch are stored back to back in a pool, offsets survive reallocation
+    size_t pool_cap = XARGS_READ_SIZE;
+    size_t pool_len = 0;
+    char* pool = malloc(pool_cap);
+
+    int item_cap = 1024;
+    int item_count = 0;
+    size_t* items = malloc(item_cap * sizeof(size_t));
+
+    //The exec argv is rebuilt from the pool for every batch
+    int cmd_cap = item_cap + fixed_count + 1;
+    char** cmd = malloc(cmd_cap * sizeof(char*));
+
+    char* chunk = malloc(XARGS_READ_SIZE);
+    pid_t* running = malloc(parallel * sizeof(pid_t));
+    int running_count = 0;
+    int result = 0;
+
+    if (pool == NULL || items == NULL || cmd == NULL || chunk == NULL || running == NULL) {
+        perror("xargs");
+        result = 1;
+        goto done;
+    }
+
+    for (int j = 0; j < fixed_count; j++) {
+        cmd[j] = fixed[j];
+    }
+
+    //Bytes consumed by the batch, including the argv pointer for every item
+    size_t batch_size = 0;
+    size_t item_start = 0;
+    bool in_item = false;
+    bool eof = false;
+
+    while (!eof) {
+        ssize_t n = read(in_fd, chunk, XARGS_READ_SIZE);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            eof = true;
+            n = 0;
+        }
+
+        //Split the chunk into items, at EOF one extra pass terminates a trailing item
+        for (ssize_t i = 0; i < n + (eof ? 1 : 0); i++) {
+            char c = (i < n) ? chunk[i] : '\0';
+            bool delim = (i == n) || (null_delim ? c == '\0' : (c == ' ' || c == '\t' || c == '\n'));
+
+            if (!delim) {
+                if (!in_item) {
+                    item_start = pool_len;
+                    in_item = true;
+                }
+
+                //Keep room for the terminator
+                if (pool_len + 2 > pool_cap) {
+                    char* temp = realloc(pool, pool_cap * 2);
+                    if (temp == NULL) {
+                        perror("xargs");
+                        result = 1;
+                        goto done;
+                    }
+                    pool = temp;
+                    pool_cap *= 2;
+                }
+
+                pool[pool_len++] = c;
+                continue;
+            }
+
+            if (!in_item) {
+                continue;
+            }
+
+            pool[pool_len++] = '\0';
+            in_item = false;
+
+            //If the finished item does not fit, launch everything before it and move it to the front
+            size_t cost = (pool_len - item_start) + sizeof(char*);
+            bool full = (item_count > 0 && batch_size + cost > budget) || (max_args > 0 && item_count >= max_args);
+
+            if (full) {
+                if (__xargs_launch(cmd, fixed_count, pool, items, item_count, running, &running_count, parallel) != 0) {
+                    result = 123;
+                }
+
+                memmove(pool, pool + item_start, pool_len - item_start);
+                pool_len -= item_start;
+                item_start = 0;
+                item_count = 0;
+                batch_size = 0;
+            }
+
+            if (item_count >= item_cap) {
+                size_t* temp_items = realloc(items, item_cap * 2 * sizeof(size_t));
+                char** temp_cmd = realloc(cmd, (item_cap * 2 + fixed_count + 1) * sizeof(char*));
+
+                if (temp_items != NULL) {
+                    items = temp_items;
+                }
+
+                if (temp_cmd != NULL) {
+                    cmd = temp_cmd;
+                }
+
+                if (temp_items == NULL || temp_cmd == NULL) {
+                    perror("xargs");
+                    result = 1;
+                    goto done;
+                }
+
+                item_cap *= 2;
+            }
+
+            items[item_count++] = item_start;
+            batch_size += cost;
+        }
+    }
+
+    //Flush the final partial batch
+    if (item_count > 0) {
+        if (__xargs_launch(cmd, fixed_count, pool, items, item_count, running, &running_count, parallel) != 0) {
+            result = 123;
+        }
+    }
+
+done:
+    //Wait for every outstanding invocation
+    if (running != NULL && __xargs_reap(running, &running_count, 1) != 0) {
+        result = 123;
+    }
+
+    if (in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+
+    free(pool);
+    free(items);
+    free(cmd);
+    free(chunk);
+    free(running);
+    return result;
+}
+
+//Helper function to compute how many bytes of arguments a single xargs invocation may carry
+size_t __xargs_budget(char** fixed, int fixed_count) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+
+    //POSIX guarantees at least 4096
+    if (arg_max <= 0) {
+        arg_max = 4096;
+    }
+
+    //Environment strings and their pointers share the same limit as argv
+    size_t used = 0;
+    for (char** env = environ; *env != NULL; env++) {
+        used += strlen(*env) + 1 + sizeof(char*);
+    }
+
+    for (int i = 0; i < fixed_count; i++) {
+        used += strlen(fixed[i]) + 1 + sizeof(char*);
+    }
+
+    //Terminating NULL pointers for argv and envp, plus headroom as recommended by POSIX
+    used += 2 * sizeof(char*) + XARGS_HEADROOM;
+
+    if ((size_t) arg_max <= used) {
+        return 0;
+    }
+
+    return (size_t) arg_max - used;
+}
+
+//Helper function to start one xargs batch, first making room if the parallel limit is reached
+int __xargs_launch(char** cmd, int fixed_count, char* pool, size_t* items, int item_count, pid_t* running, int* running_count, int parallel) {
+    int result = __xargs_reap(running, running_count, parallel);
+
+    for (int j = 0; j < item_count; j++) {
+        cmd[fixed_count + j] = pool + items[j];
+    }
+    cmd[fixed_count + item_count] = NULL;
+
+    pid_t pid = __fork_traced(cmd[0]);
+
+    if (pid == 0) {
+        //Items came from stdin, the command must not compete for it
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+
+        __exec_command(cmd);
+    }
+
+    else if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    running[(*running_count)++] = pid;
+    return result;
+}
+
+//Helper function to reap xargs invocations until fewer than limit are running, nonzero if any failed
+int __xargs_reap(pid_t* running, int* running_count, int limit) {
+    int result = 0;
+
+    while (*running_count >= limit && *running_count > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            //No children left, nothing more to wait for
+            *running_count = 0;
+            break;
+        }
+
+        __trace(TRACE_REAP, pid, status, NULL);
+
+        //Remove from the running set, order is irrelevant
+        for (int i = 0; i < *running_count; i++) {
+            if (running[i] == pid) {
+                running[i] = running[--(*running_count)];
+                break;
+            }
+        }
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+//Helper function to queue bytes for the writer thread, if the buffer is full the data is dropped instead of waiting
+void __writer_append(struct __async_writer* w, const char* data, size_t length) {
+    pthread_mutex_lock(&w->lock);
+
+    if (w->length + length > WRITER_CAPACITY) {
+        w->dropped += length;
+    }
+
+    else {
+        memcpy(w->buffer + w->length, data, length);
+        w->length += length;
+        pthread_cond_signal(&w->wake);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+//Helper function to flush everything still buffered, stop the thread and close the file
+void __writer_close(struct __async_writer* w) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    free(w->buffer);
+    free(w->spare);
+    free(w);
+}
+
+//Builtin to record the session, "record start <file>" writes an asciicast v2 file until "record stop"
+int __record(int argc, char** argv) {
+    struct __rsh* r = __rsh_get();
+
+    if (argc > 2 && strcmp(argv[1], "start") == 0) {
+        return __record_start(argv[2]);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "stop") == 0) {
+        if (r->recorder == NULL) {
+            fprintf(stderr, "record: not recording\r\n");
+            return -1;
+        }
+
+        __record_stop();
+        return 0;
+    }
+
+    if (argc == 1) {
+        printf("record %s\r\n", (r->recorder != NULL) ? "on" : "off");
+        return 0;
+    }
+
+    fprintf(stderr, "Usage: record [start <file> | stop]\r\n");
+    return -1;
+}
+
+//Helper function to start recording into a new asciicast file, the shell's output is moved onto a pseudo terminal
+//only now, so sessions that are not recorded write straight to the terminal as before
+int __record_start(const char* path) {
+    struct __rsh* r = __rsh_get();
+
+    if (r->recorder != NULL) {
+        fprintf(stderr, "record: already recording\r\n");
+        return -1;
+    }
+
+    struct __recorder* rec = calloc(1, sizeof(struct __recorder));
+    rec->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    rec->slave = -1;
+
+    if (rec->master >= 0 && grantpt(rec->master) == 0 && unlockpt(rec->master) == 0) {
+        rec->slave = open(ptsname(rec->master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    }
+
+    //A recording starts a new file, the writer only appends
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (rec->slave < 0 || fd < 0 || pipe2(rec->stop, O_CLOEXEC) != 0) {
+        perror("record");
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (rec->slave >= 0) {
+            close(rec->slave);
+        }
+
+        if (rec->master >= 0) {
+            close(rec->master);
+        }
+
+        free(rec);
+        return -1;
+    }
+
+    close(fd);
+    rec->cast = __writer_open(path);
+
+    if (rec->cast == NULL) {
+        close(rec->stop[0]);
+        close(rec->stop[1]);
+        close(rec->slave);
+        close(rec->master);
+        free(rec);
+        return -1;
+    }
+
+    //Programs see the same modes and size on the pseudo terminal as on the real one, except output processing, which the
+    //real terminal does in whatever mode the shell or a program has set on it
+    struct winsize ws;
+    struct termios modes = orig_termios;
+    modes.c_oflag &= ~OPOST;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0) {
+        ws.ws_col = r->term_width;
+        ws.ws_row = 24;
+    }
+
+    tcsetattr(rec->slave, TCSANOW, &modes);
+    ioctl(rec->slave, TIOCSWINSZ, &ws);
+
+    char header[PATH_LENGTH];
+    char term[256];
+    __json_escape(term, sizeof(term), getenv("TERM") ? getenv("TERM") : "");
+    int n = snprintf(header, sizeof(header), "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld, "
+                     "\"env\": {\"SHELL\": \"rsh\", \"TERM\": \"%s\"}}\n", ws.ws_col, ws.ws_row, (long) time(NULL), term);
+    __writer_append(rec->cast, header, n);
+    clock_gettime(CLOCK_MONOTONIC, &rec->start);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    rec->terminal = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    rec->saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    pthread_mutex_init(&rec->size_lock, NULL);
+
+    //Keep the thread from taking signals meant for the shell
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int res = pthread_create(&rec->thread, NULL, __record_relay, rec);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    //Without the relay nothing would drain the pseudo terminal, so output stays where it is
+    if (res != 0) {
+        fprintf(stderr, "Error: Could not start recording thread\r\n");
+        pthread_mutex_destroy(&rec->size_lock);
+        close(rec->terminal);
+        close(rec->saved_err);
+        close(rec->stop[0]);
+        close(rec->stop[1]);
+        close(rec->slave);
+        close(rec->master);
+        __writer_close(rec->cast);
+        free(rec);
+        return -1;
+    }
+
+    //Said on the real terminal, before output moves
+    printf("Recording to %s, 'record stop' ends it\r\n", path);
+    fflush(stdout);
+
+    dup2(rec->slave, STDOUT_FILENO);
+    dup2(rec->slave, STDERR_FILENO);
+    r->recorder = rec;
+    return 0;
+}
+
+//Helper function to end a recording, everything written so far is relayed before the real terminal is given back,
+//only the shell that started it can, a forked helper shares the pipes but not the relay thread
+void __record_stop(void) {
+    struct __rsh* r = __rsh_get();
+    struct __recorder* rec = r->recorder;
+
+    if (rec == NULL || getpid() != event_loop_pid) {
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    char byte = 0;
+    write(rec->stop[1], &byte, 1);
+    pthread_join(rec->thread, NULL);
+
+    dup2(rec->terminal, STDOUT_FILENO);
+    dup2(rec->saved_err, STDERR_FILENO);
+    r->recorder = NULL;
+
+    //Jobs still writing to the pseudo terminal get an error from now on
+    close(rec->terminal);
+    close(rec->saved_err);
+    close(rec->slave);
+    close(rec->master);
+    close(rec->stop[0]);
+    close(rec->stop[1]);
+
+    __writer_close(rec->cast);
+    pthread_mutex_destroy(&rec->size_lock);
+    free(rec);
+}
+
+//Helper function to give the pseudo terminal the size of the real one and record the resize, a program resized while
+//it runs gets SIGWINCH from the real terminal but asks its output for the size, so the relay thread calls this too
+void __record_sync_size(struct __recorder* rec) {
+    struct winsize real;
+    struct winsize shown;
+    pthread_mutex_lock(&rec->size_lock);
+
+    if (ioctl(rec->terminal, TIOCGWINSZ, &real) == 0 && ioctl(rec->slave, TIOCGWINSZ, &shown) == 0 &&
+        (real.ws_col != shown.ws_col || real.ws_row != shown.ws_row)) {
+        char size[32];
+        int n = snprintf(size, sizeof(size), "%dx%d", real.ws_col, real.ws_row);
+
+        ioctl(rec->slave, TIOCSWINSZ, &real);
+        __record_event(rec, 'r', size, n);
+    }
+
+    pthread_mutex_unlock(&rec->size_lock);
+}
+
+//Helper function to append one asciicast event, the data becomes a JSON string with anything that is not valid UTF-8
+//replaced, a character cut off at the end of output is held back for the next event
+void __record_event(struct __recorder* rec, char type, const char* data, size_t length) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - rec->start.tv_sec) + (now.tv_nsec - rec->start.tv_nsec) / 1e9;
+
+    char joined[2 * RECORD_CHUNK + sizeof(rec->partial)];
+    if (type == 'o' && rec->partial_length > 0 && length <= 2 * RECORD_CHUNK) {
+        memcpy(joined, rec->partial, rec->partial_length);
+        memcpy(joined + rec->partial_length, data, length);
+        data = joined;
+        length += rec->partial_length;
+        rec->partial_length = 0;
+    }
+
+    struct __string_builder out = {NULL, 0, 0};
+    __sb_printf(&out, "[%.6f, \"%c\", \"", elapsed, type);
+
+    for (size_t i = 0; i < length;) {
+        unsigned char c = data[i];
+
+        if (c == '"' || c == '\\') {
+            __sb_printf(&out, "\\%c", c);
+            i++;
+        }
+
+        else if (c < 0x20 || c == 0x7f) {
+            __sb_printf(&out, "\\u%04x", c);
+            i++;
+        }
+
+        else if (c < 0x80) {
+            __sb_append(&out, data + i, 1);
+            i++;
+        }
+
+        else {
+            uint32_t code;
+            int size = __utf8_decode(data + i, length - i, &code);
+
+            //A valid start of a character that the read cut off
+            int need = (c >= 0xc2 && c <= 0xdf) ? 1 : (c >= 0xe0 && c <= 0xef) ? 2 : (c >= 0xf0 && c <= 0xf4) ? 3 : 0;
+            bool cut = (type == 'o' && code == 0xfffd && need > 0 && length - i <= (size_t) need);
+            for (size_t j = i + 1; cut && j < length; j++) {
+                cut = ((data[j] & 0xc0) == 0x80);
+            }
+
+            if (cut) {
+                rec->partial_length = length - i;
+                memcpy(rec->partial, data + i, rec->partial_length);
+                break;
+            }
+
+            if (code == 0xfffd && size == 1) {
+                __sb_printf(&out, "\\ufffd");
+            }
+
+            else {
+                __sb_append(&out, data + i, size);
+            }
+
+            i += size;
+        }
+    }
+
+    __sb_printf(&out, "\"]\n");
+    __writer_append(rec->cast, out.data, out.length);
+    free(out.data);
+}
+
+//Thread that copies the pseudo terminal's output to the real terminal and the recording, once told to stop it
+//relays whatever is still buffered and returns
+void* __record_relay(void* data) {
+    struct __recorder* rec = data;
+    char chunk[RECORD_CHUNK];
+    char cooked[2 * RECORD_CHUNK];
+    struct termios modes;
+    struct pollfd fds[2] = {{rec->master, POLLIN, 0}, {rec->stop[0], POLLIN, 0}};
+    bool stopping = false;
+
+    while (true) {
+        //When stopping nothing more is waited for, otherwise the wait is cut short to follow the terminal's size
+        if (poll(fds, 2, stopping ? 0 : RECORD_SIZE_POLL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            stopping = true;
+        }
+
+        if (!stopping) {
+            __record_sync_size(rec);
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            if (stopping) {
+                break;
+            }
+            continue;
+        }
+
+        ssize_t n = read(rec->master, chunk, sizeof(chunk));
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            //Nothing is left to read, wait for the stop
+            fds[0].fd = -1;
+            continue;
+        }
+
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(rec->terminal, chunk + done, n - done);
+
+            if (w < 0 && errno != EINTR) {
+                break;
+            }
+
+            done += (w > 0) ? w : 0;
+        }
+
+        //The recording gets the bytes as the terminal displayed them, newlines included
+        if (tcgetattr(rec->terminal, &modes) == 0 && (modes.c_oflag & OPOST) && (modes.c_oflag & ONLCR)) {
+            size_t length = 0;
+
+            for (ssize_t i = 0; i < n; i++) {
+                if (chunk[i] == '\n') {
+                    cooked[length++] = '\r';
+                }
+                cooked[length++] = chunk[i];
+            }
+
+            __record_event(rec, 'o', cooked, length);
+        }
+
+        else {
+            __record_event(rec, 'o', chunk, n);
+        }
+    }
+
+    return NULL;
+}
+
+//Helper function to open a file for appending through a background writer thread
+struct __async_writer* __writer_open(const char* path) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct __async_writer* w = calloc(1, sizeof(struct __async_writer));
+    w->fd = fd;
+    w->buffer = malloc(WRITER_CAPACITY);
+    w->spare = malloc(WRITER_CAPACITY);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+
+    //Keep the thread from taking signals meant for the shell
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int res = pthread_create(&w->thread, NULL, __writer_thread, w);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (res != 0) {
+        fprintf(stderr, "Error: Could not start writer thread\r\n");
+        close(fd);
+        free(w->buffer);
+        free(w->spare);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+//Writer thread, swaps the filled buffer for the empty one under the lock and writes outside of it
+void* __writer_thread(void* arg) {
+    struct __async_writer* w = arg;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (true) {
+        while (w->length == 0 && !w->stop) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+
+        if (w->length == 0 && w->stop) {
+            break;
+        }
+
+        char* full = w->buffer;
+        size_t length = w->length;
+        w->buffer = w->spare;
+        w->spare = full;
+        w->length = 0;
+
+        pthread_mutex_unlock(&w->lock);
+
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n = write(w->fd, full + written, length - written);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            //Nothing sensible to do about a failing sink, drop the rest
+            if (n <= 0) {
+                break;
+            }
+
+            written += n;
+        }
+
+        pthread_mutex_lock(&w->lock);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}